@@ -0,0 +1,937 @@
+#include "fridge.h"
+
+#include <netdb.h> // For getaddrinfo, used by FridgeServer::listen
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// FridgeStorage methods that need the complete Refrigerator
+
+bool FridgeStorage::open(Refrigerator &target) {
+    if (::mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+        return fail("cannot create data directory " + directory);
+    }
+
+    fridge = &target;
+    uint64_t snapshotSequence = 0;
+    if (!loadSnapshot(snapshotSequence) || !replayWal(snapshotSequence)) {
+        fridge = nullptr;
+        return false;
+    }
+
+    walDescriptor = ::open(walPath().c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (walDescriptor < 0) {
+        fridge = nullptr;
+        return fail("cannot open " + walPath());
+    }
+    archiveDescriptor = ::open(archivePath().c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (archiveDescriptor < 0) {
+        fridge = nullptr;
+        return fail("cannot open " + archivePath());
+    }
+    if (!startLog(walDescriptor, WAL_MAGIC, walPath()) || !startLog(archiveDescriptor, ARCHIVE_MAGIC, archivePath())) {
+        fridge = nullptr;
+        return false;
+    }
+    target.storage = this; // From now on every change is logged
+    return true;
+}
+
+void FridgeStorage::close() {
+    if (fridge != nullptr) {
+        batchCommits = false;
+        commit();
+        fridge->storage = nullptr;
+        fridge = nullptr;
+    }
+    if (walDescriptor >= 0) {
+        ::close(walDescriptor);
+        walDescriptor = -1;
+    }
+    if (archiveDescriptor >= 0) {
+        ::close(archiveDescriptor);
+        archiveDescriptor = -1;
+    }
+}
+
+bool FridgeStorage::commit() {
+    if (batchCommits && pending.size() + pendingArchive.size() < BATCH_COMMIT_BYTES) {
+        return true;
+    }
+    // Archived history is written before the WAL so a crash never loses an event that left memory
+    if (pendingArchive.size() != 0) {
+        if (!writeAll(archiveDescriptor, pendingArchive.getBytes()) || ::fdatasync(archiveDescriptor) != 0) {
+            return fail("cannot write " + archivePath());
+        }
+        pendingArchive.clear();
+    }
+    if (pendingRecords == 0) {
+        return true;
+    }
+    if (!writeAll(walDescriptor, pending.getBytes()) || ::fdatasync(walDescriptor) != 0) {
+        return fail("cannot write " + walPath());
+    }
+    walRecords += pendingRecords;
+    pendingRecords = 0;
+    pending.clear();
+
+    if (snapshotInterval != 0 && walRecords >= snapshotInterval) {
+        return checkpoint();
+    }
+    return true;
+}
+
+bool FridgeStorage::checkpoint() {
+    if (fridge == nullptr) {
+        lastError = "storage is not open";
+        return false;
+    }
+    // Records still pending are part of the state being saved, so they are written first
+    if (pendingRecords != 0 || pendingArchive.size() != 0) {
+        size_t interval = snapshotInterval;
+        bool batching = batchCommits;
+        snapshotInterval = 0; // Avoid recursing into checkpoint() from commit()
+        batchCommits = false; // Everything pending must be on disk before the snapshot
+        bool committed = commit();
+        snapshotInterval = interval;
+        batchCommits = batching;
+        if (!committed) {
+            return false;
+        }
+    }
+    if (!writeSnapshot()) {
+        return false;
+    }
+    // The snapshot now covers every record in the WAL, so the log can start over after its header
+    if (::ftruncate(walDescriptor, static_cast<off_t>(LOG_HEADER_BYTES)) != 0 || ::fdatasync(walDescriptor) != 0) {
+        return fail("cannot truncate " + walPath());
+    }
+    walRecords = 0;
+    return true;
+}
+
+bool FridgeStorage::writeSnapshot() {
+    const ProductCatalog &catalog = *fridge->catalog;
+    const FlatProductStore &products = fridge->products;
+
+    // Lay out every section in memory first; names are appended to the blob as rows refer to them
+    string names;
+    auto addName = [&names](string_view text, uint32_t &offset, uint32_t &length) {
+        offset = static_cast<uint32_t>(names.size());
+        length = static_cast<uint32_t>(text.size());
+        names.append(text);
+    };
+
+    vector<uint32_t> order(products.size());
+    for (uint32_t slot = 0; slot < order.size(); ++slot) {
+        order[slot] = slot;
+    }
+    sort(order.begin(), order.end(), [&](uint32_t left, uint32_t right) {
+        return catalog.getName(products.getId(left)) < catalog.getName(products.getId(right));
+    });
+
+    vector<SnapshotProduct> productRows;
+    vector<SnapshotLot> lotRows;
+    productRows.reserve(order.size());
+    for (uint32_t slot : order) {
+        SnapshotProduct row = {};
+        addName(catalog.getName(products.getId(slot)), row.nameOffset, row.nameLength);
+        row.firstLot = static_cast<uint32_t>(lotRows.size());
+        row.lotCount = static_cast<uint32_t>(products.getLots(slot).size());
+        row.quantity = products.getQuantity(slot).getMilliUnits();
+        row.expirationDays = products.getExpirationDate(slot).getDays();
+        productRows.push_back(row);
+        for (const Lot &lot : products.getLots(slot)) {
+            lotRows.push_back({lot.quantity.getMilliUnits(), lot.expirationDate.getDays(), 0});
+        }
+    }
+
+    vector<SnapshotConsumption> consumedRows;
+    for (const auto &item : fridge->consumedTotals) {
+        SnapshotConsumption row = {};
+        addName(catalog.getName(item.first), row.nameOffset, row.nameLength);
+        row.quantity = item.second.getMilliUnits();
+        consumedRows.push_back(row);
+    }
+
+    vector<SnapshotBucket> bucketRows;
+    vector<SnapshotConsumption> bucketEntryRows;
+    for (const ConsumptionBucket &bucket : fridge->consumptionBuckets) {
+        bucketRows.push_back({bucket.day, static_cast<uint32_t>(bucketEntryRows.size()),
+                              static_cast<uint32_t>(bucket.consumed.size()), 0});
+        for (const auto &item : bucket.consumed) {
+            SnapshotConsumption row = {};
+            addName(catalog.getName(item.first), row.nameOffset, row.nameLength);
+            row.quantity = item.second.getMilliUnits();
+            bucketEntryRows.push_back(row);
+        }
+    }
+
+    SnapshotHeader header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.sequence = lastSequence;
+    header.productCount = static_cast<uint32_t>(productRows.size());
+    header.lotCount = static_cast<uint32_t>(lotRows.size());
+    header.consumedCount = static_cast<uint32_t>(consumedRows.size());
+    header.bucketCount = static_cast<uint32_t>(bucketRows.size());
+    header.bucketEntryCount = static_cast<uint32_t>(bucketEntryRows.size());
+    header.namesSize = static_cast<uint32_t>(names.size());
+
+    BinaryWriter snapshot;
+    auto addSection = [&snapshot](const void *rows, size_t bytes) {
+        uint64_t offset = snapshot.size();
+        snapshot.putBytes(string_view(static_cast<const char *>(rows), bytes));
+        while (snapshot.size() % 8 != 0) {
+            snapshot.put('\0'); // Keep the next section aligned for in-place access
+        }
+        return offset;
+    };
+    addSection(&header, sizeof(header)); // Rewritten below once the offsets are known
+    header.productsOffset = addSection(productRows.data(), productRows.size() * sizeof(SnapshotProduct));
+    header.lotsOffset = addSection(lotRows.data(), lotRows.size() * sizeof(SnapshotLot));
+    header.consumedOffset = addSection(consumedRows.data(), consumedRows.size() * sizeof(SnapshotConsumption));
+    header.bucketsOffset = addSection(bucketRows.data(), bucketRows.size() * sizeof(SnapshotBucket));
+    header.bucketEntriesOffset =
+        addSection(bucketEntryRows.data(), bucketEntryRows.size() * sizeof(SnapshotConsumption));
+    header.namesOffset = addSection(names.data(), names.size());
+    header.fileSize = snapshot.size();
+
+    string bytes = snapshot.getBytes();
+    header.checksum = checksum32(string_view(bytes).substr(sizeof(SnapshotHeader)));
+    memcpy(bytes.data(), &header, sizeof(header));
+
+    // Write to a temporary file and rename it over the old snapshot, so a crash leaves one or the other
+    string temporaryPath = snapshotPath() + ".tmp";
+    int descriptor = ::open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (descriptor < 0) {
+        return fail("cannot create " + temporaryPath);
+    }
+    bool written = writeAll(descriptor, bytes) && ::fsync(descriptor) == 0;
+    ::close(descriptor);
+    if (!written || ::rename(temporaryPath.c_str(), snapshotPath().c_str()) != 0) {
+        return fail("cannot write " + snapshotPath());
+    }
+
+    // Make the rename itself durable
+    int directoryDescriptor = ::open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+    if (directoryDescriptor >= 0) {
+        ::fsync(directoryDescriptor);
+        ::close(directoryDescriptor);
+    }
+    return true;
+}
+
+bool FridgeStorage::loadSnapshot(uint64_t &snapshotSequence) {
+    snapshotSequence = 0;
+    if (::access(snapshotPath().c_str(), F_OK) != 0) {
+        return true; // No snapshot yet
+    }
+    MappedSnapshot snapshot;
+    if (!snapshot.open(snapshotPath())) {
+        lastError = snapshot.getLastError();
+        return false;
+    }
+    if (snapshot.getBucketCount() != fridge->consumptionBuckets.size()) {
+        lastError = snapshotPath() + " was written with a different consumption window";
+        return false;
+    }
+
+    // Rebuild the in-memory state straight from the mapped rows
+    ProductCatalog &catalog = *fridge->catalog;
+    FlatProductStore &products = fridge->products;
+    products.reserve(snapshot.getProductCount());
+    for (uint32_t index = 0; index < snapshot.getProductCount(); ++index) {
+        ProductId productId = catalog.intern(snapshot.getProductName(index));
+        for (const SnapshotLot &lot : snapshot.getLots(index)) {
+            uint32_t slot = products.find(productId);
+            if (slot == FlatProductStore::NOT_FOUND) {
+                products.insert(productId, Quantity::fromMilliUnits(lot.quantity), Date(lot.expirationDays));
+            } else {
+                products.addLot(slot, Quantity::fromMilliUnits(lot.quantity), Date(lot.expirationDays));
+            }
+        }
+    }
+    for (uint32_t index = 0; index < snapshot.getConsumedCount(); ++index) {
+        fridge->consumedTotals[catalog.intern(snapshot.getConsumedName(index))] = snapshot.getConsumedQuantity(index);
+    }
+    for (uint32_t bucket = 0; bucket < snapshot.getBucketCount(); ++bucket) {
+        ConsumptionBucket &target = fridge->consumptionBuckets[bucket];
+        target.day = snapshot.getBucketDay(bucket);
+        snapshot.forEachBucketEntry(bucket, [&](string_view productName, Quantity quantity) {
+            target.consumed[catalog.intern(productName)] = quantity;
+        });
+    }
+    fridge->rebuildConsumptionRates(); // The rates are not stored; the buckets hold the last weeks of them
+    snapshotSequence = snapshot.getSequence();
+    return true;
+}
+
+bool FridgeStorage::replayWal(uint64_t snapshotSequence) {
+    string file;
+    if (!readFile(walPath(), file)) {
+        return fail("cannot read " + walPath());
+    }
+    string_view contents = file;
+    if (!stripLogHeader(contents, WAL_MAGIC, walPath())) {
+        return false;
+    }
+    lastSequence = snapshotSequence;
+
+    size_t validEnd = forEachFramedRecord(contents, [&](string_view record) {
+        BinaryReader fields(record);
+        uint64_t sequence = 0;
+        WalRecordType type;
+        uint32_t timestamp = 0, days = 0;
+        int64_t quantity = 0;
+        string_view name;
+        if (!fields.get(sequence) || !fields.get(type) || !fields.get(timestamp) || !fields.get(quantity) ||
+            !fields.get(days) || !fields.getString(name)) {
+            return false;
+        }
+        ++walRecords;
+        if (sequence <= snapshotSequence) {
+            return true; // Already contained in the snapshot
+        }
+
+        lastSequence = sequence;
+        ++replayedRecords;
+        switch (type) {
+        case WalRecordType::Insert:
+            fridge->applyInsert(name, Quantity::fromMilliUnits(quantity), Date(days), timestamp);
+            break;
+        case WalRecordType::Consume:
+            fridge->applyConsume(name, Quantity::fromMilliUnits(quantity), timestamp);
+            break;
+        case WalRecordType::Purge:
+            fridge->removeExpired(Date(days), false);
+            break;
+        }
+        return true;
+    });
+
+    // Drop a torn tail so new records are appended right after the last intact one
+    if (validEnd < contents.size() &&
+        ::truncate(walPath().c_str(), static_cast<off_t>(file.size() - contents.size() + validEnd)) != 0) {
+        return fail("cannot repair " + walPath());
+    }
+    return true;
+}
+
+bool FridgeStorage::startLog(int descriptor, const char (&magic)[8], const string &path) {
+    char bytes[LOG_HEADER_BYTES];
+    ssize_t length = ::pread(descriptor, bytes, sizeof(bytes), 0);
+    if (length < 0) {
+        return fail("cannot read " + path);
+    }
+    string_view contents(bytes, static_cast<size_t>(length));
+    if (!stripLogHeader(contents, magic, path)) {
+        return false;
+    }
+    if (static_cast<size_t>(length) == LOG_HEADER_BYTES) {
+        return true;
+    }
+    // A new log, or one torn while its header was being written
+    if (::ftruncate(descriptor, 0) != 0 || !writeAll(descriptor, logHeader(magic)) || ::fdatasync(descriptor) != 0) {
+        return fail("cannot start " + path);
+    }
+    return true;
+}
+
+vector<size_t> FridgeStorage::splitFramedRecords(string_view contents, size_t chunkBytes) {
+    vector<size_t> bounds{0};
+    BinaryReader reader(contents);
+    size_t validEnd = 0;
+    while (reader.remaining() > 0) {
+        uint32_t storedChecksum = 0, size = 0;
+        if (!reader.get(storedChecksum) || !reader.get(size) || reader.remaining() < size) {
+            break; // Torn write at the end of the file
+        }
+        reader.skip(size);
+        validEnd = reader.getOffset();
+        if (validEnd - bounds.back() >= chunkBytes) {
+            bounds.push_back(validEnd);
+        }
+    }
+    if (bounds.back() != validEnd) {
+        bounds.push_back(validEnd);
+    }
+    return bounds;
+}
+
+bool FridgeStorage::tallyArchivedConsumption(WorkStealingPool &pool, unordered_map<string, Quantity> &totals) {
+    totals.clear();
+    int descriptor = ::open(archivePath().c_str(), O_RDONLY | O_CLOEXEC);
+    if (descriptor < 0) {
+        return errno == ENOENT || fail("cannot open " + archivePath()); // No archive yet
+    }
+    struct stat status;
+    if (::fstat(descriptor, &status) != 0) {
+        ::close(descriptor);
+        return fail("cannot read " + archivePath());
+    }
+    size_t size = static_cast<size_t>(status.st_size);
+    if (size == 0) {
+        ::close(descriptor);
+        return true;
+    }
+    // Mapped rather than read, so the pages of a large archive are faulted in by the threads using them
+    void *mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    ::close(descriptor);
+    if (mapping == MAP_FAILED) {
+        return fail("cannot map " + archivePath());
+    }
+    string_view contents(static_cast<const char *>(mapping), size);
+    if (!stripLogHeader(contents, ARCHIVE_MAGIC, archivePath())) {
+        ::munmap(mapping, size);
+        return false;
+    }
+
+    struct Run {
+        unordered_map<string_view, Quantity> consumed; // Keyed by names viewing into the mapping
+        bool intact = true; // Whether every record of the run was read
+    };
+    vector<size_t> bounds = splitFramedRecords(contents, TALLY_CHUNK_BYTES);
+    vector<Run> runs(bounds.size() - 1);
+    pool.parallelFor(runs.size(), [&](size_t index, size_t) {
+        Run &run = runs[index];
+        string_view records = contents.substr(bounds[index], bounds[index + 1] - bounds[index]);
+        size_t validEnd = forEachFramedRecord(records, [&](string_view record) {
+            HistoryEvent event;
+            string_view name;
+            if (!decodeArchivedEvent(record, name, event)) {
+                return false;
+            }
+            if (event.type == ActionType::Consume) {
+                run.consumed[name] += event.quantity;
+            }
+            return true;
+        });
+        run.intact = validEnd == records.size();
+    });
+
+    // Merge in file order; a sequential reader stops at the first damaged record, and so does this
+    unordered_map<string_view, Quantity> merged;
+    for (const Run &run : runs) {
+        for (const auto &item : run.consumed) {
+            merged[item.first] += item.second;
+        }
+        if (!run.intact) {
+            break;
+        }
+    }
+    totals.reserve(merged.size());
+    for (const auto &item : merged) {
+        totals.emplace(item.first, item.second);
+    }
+    ::munmap(mapping, size);
+    return true;
+}
+
+// FridgeServer methods, kept out of the header with the socket and epoll headers they need
+
+bool FridgeServer::listen(const string &address) {
+    close();
+    stopping.store(false, memory_order_relaxed);
+    epollDescriptor = epoll_create1(EPOLL_CLOEXEC);
+    if (epollDescriptor < 0) {
+        return fail("cannot create the event loop");
+    }
+    wakeDescriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeDescriptor < 0) {
+        return fail("cannot create the wake-up descriptor");
+    }
+    if (!watch(wakeDescriptor, EPOLLIN, EPOLL_CTL_ADD)) {
+        return false;
+    }
+
+    bool listening;
+    if (address.starts_with("unix:")) {
+        listening = listenUnix(address.substr(5));
+    } else {
+        size_t colon = address.rfind(':');
+        if (colon == string::npos) {
+            errno = EINVAL;
+            return fail("invalid address '" + address + "' (expected unix:<path> or <host>:<port>)");
+        }
+        string host = address.substr(0, colon);
+        if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2); // [::1]:port
+        }
+        listening = listenTcp(host, address.substr(colon + 1));
+    }
+    return listening && watch(listenDescriptor, EPOLLIN, EPOLL_CTL_ADD);
+}
+
+bool FridgeServer::listenUnix(const string &path) {
+    sockaddr_un socketAddress = {};
+    socketAddress.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(socketAddress.sun_path)) {
+        errno = ENAMETOOLONG;
+        return fail("invalid socket path '" + path + "'");
+    }
+    memcpy(socketAddress.sun_path, path.data(), path.size());
+
+    listenDescriptor = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenDescriptor < 0) {
+        return fail("cannot create a socket");
+    }
+    // A socket file left by an earlier run would make bind fail; anything else at the path is kept
+    struct stat existing;
+    if (::lstat(path.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+        ::unlink(path.c_str());
+    }
+    if (::bind(listenDescriptor, reinterpret_cast<const sockaddr *>(&socketAddress), sizeof(socketAddress)) != 0) {
+        return fail("cannot bind " + path);
+    }
+    socketPath = path;
+    if (::listen(listenDescriptor, SOMAXCONN) != 0) {
+        return fail("cannot listen on " + path);
+    }
+    return true;
+}
+
+bool FridgeServer::listenTcp(const string &host, const string &port) {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo *candidates = nullptr;
+    int error = ::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &candidates);
+    if (error != 0) {
+        lastError = "cannot resolve " + host + ":" + port + ": " + gai_strerror(error);
+        return false;
+    }
+
+    // Listen on the first address that works
+    for (addrinfo *candidate = candidates; candidate != nullptr && listenDescriptor < 0; candidate = candidate->ai_next) {
+        int descriptor = ::socket(candidate->ai_family, candidate->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                                  candidate->ai_protocol);
+        if (descriptor < 0) {
+            continue;
+        }
+        int enable = 1;
+        ::setsockopt(descriptor, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        if (::bind(descriptor, candidate->ai_addr, candidate->ai_addrlen) == 0 && ::listen(descriptor, SOMAXCONN) == 0) {
+            listenDescriptor = descriptor;
+        } else {
+            ::close(descriptor);
+        }
+    }
+    ::freeaddrinfo(candidates);
+    return listenDescriptor >= 0 || fail("cannot listen on " + host + ":" + port);
+}
+
+bool FridgeServer::watch(int descriptor, uint32_t events, int operation) {
+    epoll_event event = {};
+    event.events = events;
+    event.data.fd = descriptor;
+    return ::epoll_ctl(epollDescriptor, operation, descriptor, &event) == 0 || fail("cannot watch a descriptor");
+}
+
+bool FridgeServer::run() {
+    epoll_event events[64];
+    auto nextDelivery = chrono::steady_clock::time_point::max();
+    while (!stopping.load(memory_order_relaxed)) {
+        // Sleep until a client needs attention or the next subscription is due
+        int timeout = -1;
+        if (nextDelivery != chrono::steady_clock::time_point::max()) {
+            auto wait = chrono::ceil<chrono::milliseconds>(nextDelivery - chrono::steady_clock::now());
+            timeout = static_cast<int>(clamp<chrono::milliseconds::rep>(wait.count(), 0, INT32_MAX));
+        }
+        int count = ::epoll_wait(epollDescriptor, events, 64, timeout);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return fail("the event loop failed");
+        }
+        for (int i = 0; i < count; ++i) {
+            int descriptor = events[i].data.fd;
+            if (descriptor == wakeDescriptor) {
+                uint64_t value;
+                ssize_t drained = ::read(wakeDescriptor, &value, sizeof(value));
+                (void)drained; // Only wakes the loop up; `stopping` says why
+                continue;
+            }
+            if (descriptor == listenDescriptor) {
+                acceptConnections();
+                continue;
+            }
+            auto found = connections.find(descriptor);
+            if (found == connections.end()) {
+                continue;
+            }
+            Connection &connection = *found->second;
+            if ((events[i].events & EPOLLERR) != 0) {
+                closeConnection(descriptor);
+                continue;
+            }
+            bool open = true;
+            if ((events[i].events & (EPOLLIN | EPOLLHUP)) != 0) {
+                open = handleReadable(connection);
+            }
+            if (open && (events[i].events & EPOLLOUT) != 0) {
+                sendOutput(connection);
+            }
+        }
+        nextDelivery = deliverChanges();
+    }
+    return true;
+}
+
+chrono::steady_clock::time_point FridgeServer::deliverChanges() {
+    auto nextDelivery = fridge.deliverChanges();
+    for (int descriptor : notified) {
+        auto found = connections.find(descriptor);
+        if (found != connections.end()) {
+            sendOutput(*found->second);
+        }
+    }
+    notified.clear();
+    return nextDelivery;
+}
+
+void FridgeServer::acceptConnections() {
+    while (true) {
+        int descriptor = ::accept4(listenDescriptor, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (descriptor < 0) {
+            return; // None left (or out of descriptors; the listener stays readable and is retried)
+        }
+        int enable = 1;
+        ::setsockopt(descriptor, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)); // Fails harmlessly on Unix sockets
+        if (!watch(descriptor, EPOLLIN, EPOLL_CTL_ADD)) {
+            ::close(descriptor);
+            continue;
+        }
+        auto connection = make_unique<Connection>();
+        connection->descriptor = descriptor;
+        connection->events = EPOLLIN;
+        connections.emplace(descriptor, move(connection));
+        ++stats.connections;
+    }
+}
+
+bool FridgeServer::handleReadable(Connection &connection) {
+    // Take what has arrived, up to a bound so that one busy client cannot starve the others
+    char chunk[64 * 1024];
+    for (size_t total = 0; total < 4 * sizeof(chunk);) {
+        ssize_t received = ::recv(connection.descriptor, chunk, sizeof(chunk), 0);
+        if (received > 0) {
+            connection.input.append(chunk, static_cast<size_t>(received));
+            total += static_cast<size_t>(received);
+        } else if (received == 0) {
+            connection.closing = true; // The client is done sending; answer what it sent, then close
+            break;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else {
+            closeConnection(connection.descriptor);
+            return false;
+        }
+    }
+    handleInput(connection);
+    return sendOutput(connection);
+}
+
+bool FridgeServer::sendOutput(Connection &connection) {
+    const string &bytes = connection.output.getBytes();
+    while (connection.sent < bytes.size()) {
+        ssize_t written = ::send(connection.descriptor, bytes.data() + connection.sent, bytes.size() - connection.sent,
+                                 MSG_NOSIGNAL);
+        if (written >= 0) {
+            connection.sent += static_cast<size_t>(written);
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break; // The socket buffer is full; EPOLLOUT says when to go on
+        } else {
+            closeConnection(connection.descriptor);
+            return false;
+        }
+    }
+    if (connection.sent == bytes.size()) {
+        connection.output.clear();
+        connection.sent = 0;
+        if (connection.closing) {
+            closeConnection(connection.descriptor);
+            return false;
+        }
+    }
+    updateEvents(connection);
+    return true;
+}
+
+void FridgeServer::handleInput(Connection &connection) {
+    string_view input = connection.input;
+    BinaryReader frames(input); // The frame sizes are little-endian like the rest of the protocol
+    size_t offset = 0; // End of the last complete frame
+    uint32_t size = 0;
+    while (frames.get(size)) {
+        if (size > MAX_FRAME_BYTES) {
+            connection.closing = true; // Not a client of this protocol
+            break;
+        }
+        if (frames.remaining() < size) {
+            break; // Wait for the rest of the frame
+        }
+        BinaryReader request(input.substr(frames.getOffset(), size));
+        frames.skip(size);
+        offset = frames.getOffset();
+        handleRequest(connection, request);
+    }
+    flushRun(connection); // Before the input it points into is discarded
+    connection.input.erase(0, offset);
+}
+
+void FridgeServer::handleRequest(Connection &connection, BinaryReader &request) {
+    uint32_t requestId = 0;
+    ServerOpcode opcode;
+    if (request.get(requestId) && request.get(opcode)) {
+        string_view name;
+        int64_t milliUnits = 0;
+        uint32_t days = 0;
+        switch (opcode) {
+        case ServerOpcode::Insert:
+            if (request.getString(name) && request.get(milliUnits) && request.get(days) && request.remaining() == 0) {
+                if (name.empty() || !Date(days).isValid()) {
+                    flushRun(connection); // Still answered in order
+                    respond(connection, requestId, name.empty() ? ServerStatus::InvalidName : ServerStatus::InvalidDate);
+                    return;
+                }
+                if (!consumeRun.empty()) {
+                    flushRun(connection);
+                }
+                insertRun.push_back({name, Quantity::fromMilliUnits(milliUnits), Date(days)});
+                runIds.push_back(requestId);
+                return;
+            }
+            break;
+        case ServerOpcode::Consume:
+            if (request.getString(name) && request.get(milliUnits) && request.remaining() == 0) {
+                if (name.empty()) {
+                    flushRun(connection); // Still answered in order
+                    respond(connection, requestId, ServerStatus::InvalidName);
+                    return;
+                }
+                if (!insertRun.empty()) {
+                    flushRun(connection);
+                }
+                consumeRun.push_back({name, Quantity::fromMilliUnits(milliUnits)});
+                runIds.push_back(requestId);
+                return;
+            }
+            break;
+        case ServerOpcode::Status:
+            if (request.remaining() == 0) {
+                flushRun(connection);
+                writeStatus();
+                respond(connection, requestId, ServerStatus::Ok);
+                return;
+            }
+            break;
+        case ServerOpcode::Expirations:
+            flushRun(connection);
+            if (ServerStatus status = writeExpirations(request); status != ServerStatus::BadRequest) {
+                respond(connection, requestId, status);
+                return;
+            }
+            break;
+        case ServerOpcode::ShoppingList:
+            flushRun(connection);
+            if (writeShoppingList(request)) {
+                respond(connection, requestId, ServerStatus::Ok);
+                return;
+            }
+            break;
+        case ServerOpcode::Subscribe:
+            flushRun(connection); // Changes made before the subscription are not reported
+            if (subscribe(connection, requestId, request)) {
+                respond(connection, requestId, ServerStatus::Ok);
+                return;
+            }
+            break;
+        case ServerOpcode::Unsubscribe:
+            flushRun(connection); // Earlier inserts and consumes are answered (and delivered) first
+            if (unsubscribe(connection, request)) {
+                respond(connection, requestId, ServerStatus::Ok);
+                return;
+            }
+            break;
+        }
+    }
+    flushRun(connection);
+    body.clear();
+    respond(connection, requestId, ServerStatus::BadRequest);
+}
+
+void FridgeServer::flushRun(Connection &connection) {
+    if (runIds.empty()) {
+        return;
+    }
+    vector<OperationStatus> results = insertRun.empty() ? fridge.consumeBatch(consumeRun) : fridge.insertBatch(insertRun);
+    for (size_t i = 0; i < results.size(); ++i) {
+        respond(connection, runIds[i], static_cast<ServerStatus>(results[i]));
+    }
+    insertRun.clear();
+    consumeRun.clear();
+    runIds.clear();
+    ++stats.batches;
+}
+
+void FridgeServer::writeStatus() {
+    uint32_t count = 0;
+    body.put(count);
+    fridge.forEachProduct([&](const string &name, Quantity quantity, const Date &expiration, const LotList &lots) {
+        body.putString(name);
+        body.put(quantity.getMilliUnits());
+        body.put(expiration.getDays());
+        body.put(static_cast<uint32_t>(lots.size()));
+        ++count;
+    });
+    body.putAt(0, count);
+}
+
+ServerStatus FridgeServer::writeExpirations(BinaryReader &request) {
+    uint32_t days = 0;
+    uint8_t purge = 0;
+    if (!request.get(days) || !request.get(purge) || request.remaining() != 0) {
+        return ServerStatus::BadRequest;
+    }
+    if (!Date(days).isValid()) {
+        return ServerStatus::InvalidDate;
+    }
+    ExpiringView view = fridge.findExpiring(Date(days));
+    body.put(static_cast<uint32_t>(view.size()));
+    for (const ExpiringItem &item : view) {
+        body.putString(item.name);
+        body.put(item.expiringQuantity.getMilliUnits());
+        body.put(item.remainingQuantity.getMilliUnits());
+        body.put(item.earliestExpiration.getDays());
+    }
+    if (purge != 0) {
+        fridge.purgeExpired(view);
+    }
+    return ServerStatus::Ok;
+}
+
+bool FridgeServer::writeShoppingList(BinaryReader &request) {
+    uint32_t days = 0;
+    if (!request.get(days) || request.remaining() != 0) {
+        return false;
+    }
+    uint32_t count = 0;
+    body.put(count);
+    auto visit = [&](string_view name, Quantity quantity) {
+        body.putString(name);
+        body.put(quantity.getMilliUnits());
+        ++count;
+    };
+    if (days == 0) {
+        fridge.forEachConsumption(visit);
+    } else {
+        fridge.forEachConsumptionWithin(days, visit);
+    }
+    body.putAt(0, count);
+    return true;
+}
+
+bool FridgeServer::subscribe(Connection &connection, uint32_t requestId, BinaryReader &request) {
+    uint8_t watched = 0;
+    uint32_t intervalMilliseconds = 0;
+    if (!request.get(watched) || !request.get(intervalMilliseconds) || request.remaining() != 0 ||
+        (watched & CHANGE_ALL) == 0 || intervalMilliseconds == 0) {
+        return false;
+    }
+    int descriptor = connection.descriptor;
+    auto deliver = [this, descriptor, requestId](span<const ProductChange> changes) {
+        // A subscription is cancelled when its connection closes, so the connection is still there
+        Connection &target = *connections.at(descriptor);
+        body.put(static_cast<uint32_t>(changes.size()));
+        for (const ProductChange &change : changes) {
+            body.putString(change.name);
+            body.put(change.changes);
+            body.put(change.quantity.getMilliUnits());
+            body.put(change.earliestExpiration.getDays());
+            body.put(change.lotCount);
+        }
+        writeFrame(target, requestId, ServerStatus::Changes);
+        notified.push_back(descriptor);
+        ++stats.deliveries;
+    };
+    SubscriptionId id = fridge.subscribe(watched, chrono::milliseconds(intervalMilliseconds), deliver);
+    connection.subscriptions.push_back(id);
+    body.put(id);
+    return true;
+}
+
+bool FridgeServer::unsubscribe(Connection &connection, BinaryReader &request) {
+    SubscriptionId id = 0;
+    if (!request.get(id) || request.remaining() != 0 || erase(connection.subscriptions, id) == 0) {
+        return false;
+    }
+    fridge.unsubscribe(id);
+    return true;
+}
+
+void FridgeServer::updateEvents(Connection &connection) {
+    size_t pending = connection.output.size() - connection.sent;
+    uint32_t events = 0;
+    if (pending > 0) {
+        events |= EPOLLOUT;
+    }
+    if (!connection.closing && pending < MAX_PENDING_OUTPUT) {
+        events |= EPOLLIN; // Otherwise stop reading until the client takes its responses
+    }
+    if (events != connection.events && watch(connection.descriptor, events, EPOLL_CTL_MOD)) {
+        connection.events = events;
+    }
+}
+
+void FridgeServer::closeConnection(int descriptor) {
+    for (SubscriptionId id : connections.at(descriptor)->subscriptions) {
+        fridge.unsubscribe(id);
+    }
+    ::close(descriptor); // Also removes it from the epoll set
+    connections.erase(descriptor);
+}
+
+void FridgeServer::close() {
+    for (const auto &item : connections) {
+        for (SubscriptionId id : item.second->subscriptions) {
+            fridge.unsubscribe(id);
+        }
+        ::close(item.first);
+    }
+    connections.clear();
+    for (int *descriptor : {&listenDescriptor, &epollDescriptor, &wakeDescriptor}) {
+        if (*descriptor >= 0) {
+            ::close(*descriptor);
+            *descriptor = -1;
+        }
+    }
+    if (!socketPath.empty()) {
+        ::unlink(socketPath.c_str());
+        socketPath.clear();
+    }
+}
+
+uint16_t FridgeServer::getPort() const {
+    sockaddr_storage address = {};
+    socklen_t length = sizeof(address);
+    if (listenDescriptor < 0 || ::getsockname(listenDescriptor, reinterpret_cast<sockaddr *>(&address), &length) != 0) {
+        return 0;
+    }
+    if (address.ss_family == AF_INET) {
+        return ntohs(reinterpret_cast<const sockaddr_in *>(&address)->sin_port);
+    }
+    if (address.ss_family == AF_INET6) {
+        return ntohs(reinterpret_cast<const sockaddr_in6 *>(&address)->sin6_port);
+    }
+    return 0;
+}
@@ -0,0 +1,4781 @@
+// Refrigerator inventory library: products and lots, the refrigerator itself, its durable storage,
+// and the concurrent and fleet-wide front ends. Used by the command line program (hui.cpp) and the benchmarks.
+#ifndef FRIDGE_H
+#define FRIDGE_H
+
+#include <iostream>
+#include <unordered_map>
+#include <map>
+#include <deque>
+#include <memory>
+#include <memory_resource>
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <cerrno>
+#include <fstream>
+#include <type_traits>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <array>
+#include <span>
+#include <cstdint>
+#include <ctime>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Per-operation counters and latency histograms (see RefrigeratorMetrics). Without them the recording
+// calls compile to nothing
+#ifndef FRIDGE_ENABLE_METRICS
+#define FRIDGE_ENABLE_METRICS 0
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRIDGE_HAVE_AVX2_KERNEL 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define FRIDGE_HAVE_NEON_KERNEL 1
+#endif
+
+using namespace std;
+
+// Date class represents a calendar day as the number of days since 1970-01-01,
+// so comparing two dates is a single integer compare and no string is stored.
+class Date {
+private:
+    uint32_t days; // Days since the Unix epoch
+
+    // Private helper function to tell whether a year is a leap year
+    static constexpr bool isLeapYear(uint32_t year) {
+        return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    }
+
+    // Private helper function to get the number of days in a month of a given year
+    static constexpr uint32_t daysInMonth(uint32_t year, uint32_t month) {
+        constexpr uint8_t lengths[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+        return month == 2 && isLeapYear(year) ? 29 : lengths[month - 1];
+    }
+
+    // Private helper function to read a fixed-width run of digits, failing on any other character
+    static constexpr bool parseDigits(string_view text, uint32_t &value) {
+        value = 0;
+        for (char c : text) {
+            if (c < '0' || c > '9') {
+                return false;
+            }
+            value = value * 10 + static_cast<uint32_t>(c - '0');
+        }
+        return true;
+    }
+
+public:
+    static constexpr uint32_t MAX_DAYS = 2932896; // 9999-12-31, the last day parse() accepts and toString() prints
+
+    // Default constructor initializes the date to 1970-01-01
+    constexpr Date() : days(0) {}
+
+    // Constructor from a raw number of days since the Unix epoch
+    constexpr explicit Date(uint32_t daysSinceEpoch) : days(daysSinceEpoch) {}
+
+    // Method to build a date from a year, month and day (the values must already be valid)
+    static constexpr Date fromCivil(uint32_t year, uint32_t month, uint32_t day) {
+        // Shift the year to start in March so the leap day is the last day of the year
+        uint32_t shiftedYear = month <= 2 ? year - 1 : year;
+        uint32_t era = shiftedYear / 400;
+        uint32_t yearOfEra = shiftedYear - era * 400;
+        uint32_t dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+        uint32_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+        return Date(era * 146097 + dayOfEra - 719468);
+    }
+
+    // Method to parse a YYYY-MM-DD date. Returns false (leaving result untouched) if the text is malformed,
+    // the calendar day does not exist, or it is before 1970
+    static constexpr bool parse(string_view text, Date &result) {
+        uint32_t year = 0, month = 0, day = 0;
+        if (text.size() != 10 || text[4] != '-' || text[7] != '-') {
+            return false;
+        }
+        if (!parseDigits(text.substr(0, 4), year) || !parseDigits(text.substr(5, 2), month) ||
+            !parseDigits(text.substr(8, 2), day)) {
+            return false;
+        }
+        if (year < 1970 || month < 1 || month > 12 || day < 1 || day > daysInMonth(year, month)) {
+            return false;
+        }
+        result = fromCivil(year, month, day);
+        return true;
+    }
+
+    // Method to get the current date (UTC)
+    static Date today() {
+        return Date(static_cast<uint32_t>(time(nullptr) / 86400));
+    }
+
+    // Getter method to retrieve the number of days since the Unix epoch
+    constexpr uint32_t getDays() const {
+        return days;
+    }
+
+    // Method to tell whether the date is one parse() could have produced (a raw day count may be beyond it)
+    constexpr bool isValid() const {
+        return days <= MAX_DAYS;
+    }
+
+    // Method to format the date as YYYY-MM-DD
+    string toString() const {
+        uint32_t shifted = days + 719468;
+        uint32_t era = shifted / 146097;
+        uint32_t dayOfEra = shifted - era * 146097;
+        uint32_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+        uint32_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+        uint32_t shiftedMonth = (5 * dayOfYear + 2) / 153;
+        uint32_t day = dayOfYear - (153 * shiftedMonth + 2) / 5 + 1;
+        uint32_t month = shiftedMonth < 10 ? shiftedMonth + 3 : shiftedMonth - 9;
+        uint32_t year = yearOfEra + era * 400 + (month <= 2 ? 1 : 0);
+
+        char buffer[11] = {
+            static_cast<char>('0' + year / 1000 % 10), static_cast<char>('0' + year / 100 % 10),
+            static_cast<char>('0' + year / 10 % 10), static_cast<char>('0' + year % 10), '-',
+            static_cast<char>('0' + month / 10), static_cast<char>('0' + month % 10), '-',
+            static_cast<char>('0' + day / 10), static_cast<char>('0' + day % 10), '\0'};
+        return string(buffer, 10);
+    }
+
+    constexpr bool operator==(const Date &other) const { return days == other.days; }
+    constexpr bool operator!=(const Date &other) const { return days != other.days; }
+    constexpr bool operator<(const Date &other) const { return days < other.days; }
+    constexpr bool operator<=(const Date &other) const { return days <= other.days; }
+    constexpr bool operator>(const Date &other) const { return days > other.days; }
+    constexpr bool operator>=(const Date &other) const { return days >= other.days; }
+};
+
+static_assert(Date::fromCivil(1970, 1, 1).getDays() == 0, "the epoch must be day zero");
+static_assert(Date::fromCivil(2000, 3, 1).getDays() == 11017, "leap day handling must match the civil calendar");
+static_assert(Date::fromCivil(9999, 12, 31).getDays() == Date::MAX_DAYS, "MAX_DAYS must be the last four-digit year");
+
+// Quantity is an amount of a product in fixed point: a whole number of thousandths of a unit (milli-units)
+// in an int64_t. Sums and differences are exact, so consuming 0.1 and then 0.2 of 0.3 leaves exactly zero
+// instead of 5e-17, and adding or comparing quantities is integer arithmetic. A double converts implicitly,
+// rounded to the nearest thousandth, so callers keep passing plain numbers. A number that does not fit
+// (NaN, an infinity, or beyond about ±9.2e15 units) makes an invalid quantity, which every operation rejects.
+class Quantity {
+private:
+    int64_t milliUnits;
+
+    static constexpr double MILLI_UNIT_LIMIT = 9223372036854775808.0; // 2^63, just past the int64_t range
+
+public:
+    static constexpr int64_t SCALE = 1000; // Milli-units per unit
+    static constexpr int64_t INVALID = INT64_MIN; // Milli-units of a quantity made from a number that does not fit
+
+    // Default constructor for a zero quantity
+    constexpr Quantity() : milliUnits(0) {}
+
+    // Constructor from a number of units, rounded to the nearest milli-unit (half away from zero)
+    constexpr Quantity(double units)
+        : milliUnits(isRepresentable(units) ? static_cast<int64_t>(units * SCALE + (units < 0 ? -0.5 : 0.5))
+                                            : INVALID) {}
+
+    // Method to tell whether a number of units fits in a quantity: finite and within the int64_t range
+    // once scaled (NaN fails both comparisons)
+    static constexpr bool isRepresentable(double units) {
+        return units * SCALE > -MILLI_UNIT_LIMIT && units * SCALE < MILLI_UNIT_LIMIT;
+    }
+
+    // Method to make a quantity from a raw number of milli-units
+    static constexpr Quantity fromMilliUnits(int64_t value) {
+        Quantity quantity;
+        quantity.milliUnits = value;
+        return quantity;
+    }
+
+    // Getter method to retrieve the raw number of milli-units
+    constexpr int64_t getMilliUnits() const {
+        return milliUnits;
+    }
+
+    // Method to tell whether the quantity was made from a representable number
+    constexpr bool isValid() const {
+        return milliUnits != INVALID;
+    }
+
+    // Method to tell whether adding another quantity would take the sum out of the int64_t range
+    constexpr bool sumOverflows(const Quantity &other) const {
+        int64_t sum = 0;
+        return __builtin_add_overflow(milliUnits, other.milliUnits, &sum);
+    }
+
+    // Method to convert to a number of units, for rates and other statistics that are not exact anyway
+    constexpr double toDouble() const {
+        return static_cast<double>(milliUnits) / SCALE;
+    }
+
+    constexpr Quantity &operator+=(const Quantity &other) { milliUnits += other.milliUnits; return *this; }
+    constexpr Quantity &operator-=(const Quantity &other) { milliUnits -= other.milliUnits; return *this; }
+    constexpr Quantity operator+(const Quantity &other) const { return fromMilliUnits(milliUnits + other.milliUnits); }
+    constexpr Quantity operator-(const Quantity &other) const { return fromMilliUnits(milliUnits - other.milliUnits); }
+
+    constexpr bool operator==(const Quantity &other) const { return milliUnits == other.milliUnits; }
+    constexpr bool operator!=(const Quantity &other) const { return milliUnits != other.milliUnits; }
+    constexpr bool operator<(const Quantity &other) const { return milliUnits < other.milliUnits; }
+    constexpr bool operator<=(const Quantity &other) const { return milliUnits <= other.milliUnits; }
+    constexpr bool operator>(const Quantity &other) const { return milliUnits > other.milliUnits; }
+    constexpr bool operator>=(const Quantity &other) const { return milliUnits >= other.milliUnits; }
+};
+
+static_assert(Quantity(0.1) + Quantity(0.2) == Quantity(0.3), "quantities must add exactly");
+static_assert(Quantity(-1.5).getMilliUnits() == -1500, "negative quantities must round symmetrically");
+static_assert(!Quantity(1e300).isValid() && !Quantity(-1e300).isValid(), "out-of-range numbers must be rejected");
+
+// Dense integer id of an interned product name (see ProductCatalog)
+using ProductId = uint32_t;
+
+// ProductCatalog interns product names and hands out dense ProductIds, so refrigerators, history
+// events and indexes refer to a product by a 4-byte id and each name is stored once. A catalog is
+// shared (through shared_ptr) by every Refrigerator that uses the same product range, possibly from
+// several threads: lookups take a shared lock and only the first sighting of a name takes it exclusively.
+class ProductCatalog {
+private:
+    deque<string> names; // Interned names indexed by id; a deque never moves its elements, so the views below stay valid
+    unordered_map<string_view, ProductId> ids; // Lookup from a name (viewing into names) to its id
+    mutable shared_mutex lock; // Guards names and ids
+
+public:
+    // Method to get the id of a product name, assigning a new one the first time the name is seen
+    ProductId intern(string_view productName) {
+        {
+            shared_lock<shared_mutex> reading(lock);
+            auto it = ids.find(productName);
+            if (it != ids.end()) {
+                return it->second;
+            }
+        }
+
+        unique_lock<shared_mutex> writing(lock);
+        auto it = ids.find(productName); // Another thread may have added it in between
+        if (it != ids.end()) {
+            return it->second;
+        }
+        ProductId productId = static_cast<ProductId>(names.size());
+        names.emplace_back(productName); // The only allocation made for a name
+        ids.emplace(names.back(), productId);
+        return productId;
+    }
+
+    // Method to look up the id of a name without interning it. Returns false if the name is unknown
+    bool find(string_view productName, ProductId &productId) const {
+        shared_lock<shared_mutex> reading(lock);
+        auto it = ids.find(productName);
+        if (it == ids.end()) {
+            return false;
+        }
+        productId = it->second;
+        return true;
+    }
+
+    // Getter method to retrieve the name of an interned product. The reference stays valid for the
+    // lifetime of the catalog, since names are never changed or moved once interned
+    const string &getName(ProductId productId) const {
+        shared_lock<shared_mutex> reading(lock);
+        return names[productId];
+    }
+
+    // Getter method to retrieve the number of interned names
+    size_t size() const {
+        shared_lock<shared_mutex> reading(lock);
+        return names.size();
+    }
+};
+
+// Usage counters kept by a CountingResource
+struct MemoryStats {
+    size_t bytesInUse = 0; // Bytes allocated and not yet freed
+    size_t peakBytesInUse = 0; // Highest bytesInUse seen
+    size_t allocations = 0; // Number of allocations served
+    size_t deallocations = 0; // Number of allocations freed
+};
+
+// CountingResource forwards every request to another memory resource and counts it. Like the pool
+// resources it is usually stacked with, it is not safe to use from several threads at once.
+class CountingResource : public pmr::memory_resource {
+private:
+    pmr::memory_resource *upstream;
+    MemoryStats stats;
+
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        void *pointer = upstream->allocate(bytes, alignment);
+        stats.bytesInUse += bytes;
+        stats.peakBytesInUse = max(stats.peakBytesInUse, stats.bytesInUse);
+        ++stats.allocations;
+        return pointer;
+    }
+
+    void do_deallocate(void *pointer, size_t bytes, size_t alignment) override {
+        upstream->deallocate(pointer, bytes, alignment);
+        stats.bytesInUse -= bytes;
+        ++stats.deallocations;
+    }
+
+    bool do_is_equal(const pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+public:
+    explicit CountingResource(pmr::memory_resource *upstreamResource = pmr::get_default_resource())
+        : upstream(upstreamResource) {}
+
+    // Getter method to retrieve the counters
+    const MemoryStats &getStats() const {
+        return stats;
+    }
+};
+
+// Usage of a MemoryPool: what its users hold, and what the pool itself took from the system
+struct PoolStats {
+    MemoryStats used; // Allocations made by the pool's users (containers of a refrigerator)
+    MemoryStats reserved; // Chunks the pool requested from its upstream resource
+};
+
+// MemoryPool recycles the small, frequently freed blocks of a refrigerator: lot lists of products that
+// come and go, history growth, and the nodes of the consumption maps. Freed blocks go back to per-size
+// free lists instead of the global heap, so a week of churn does not fragment it. Single-threaded: give
+// every refrigerator that runs on its own thread (e.g. every shard of a ConcurrentRefrigerator) its own pool.
+class MemoryPool {
+private:
+    CountingResource upstreamCounter; // Counts what the pool takes from the system
+    pmr::unsynchronized_pool_resource pool;
+    CountingResource userCounter; // Counts what the refrigerator takes from the pool
+
+public:
+    explicit MemoryPool(pmr::memory_resource *upstream = pmr::new_delete_resource())
+        : upstreamCounter(upstream), pool(&upstreamCounter), userCounter(&pool) {}
+
+    MemoryPool(const MemoryPool &) = delete;
+    MemoryPool &operator=(const MemoryPool &) = delete;
+
+    // Getter method to retrieve the resource to hand to a Refrigerator
+    pmr::memory_resource *getResource() {
+        return &userCounter;
+    }
+
+    // Getter method to retrieve the usage counters
+    PoolStats getStats() const {
+        return {userCounter.getStats(), upstreamCounter.getStats()};
+    }
+};
+
+// A single delivery (lot) of a product: how much of it arrived and when it expires
+struct Lot {
+    Quantity quantity; // The quantity remaining in this lot
+    Date expirationDate; // The expiration date of this lot
+};
+
+// LotList keeps the lots of one product sorted by expiration date (earliest first).
+// Up to INLINE_CAPACITY lots live inside the object itself, so the common single-delivery
+// product never touches the heap; only products with more lots spill to a vector.
+class LotList {
+private:
+    static const uint32_t INLINE_CAPACITY = 1;
+
+    Lot inlineLots[INLINE_CAPACITY]; // Storage used while the list fits inline
+    uint32_t inlineCount; // Number of lots used in inlineLots
+    pmr::vector<Lot> spilledLots; // Storage used once the list outgrows the inline slots (empty otherwise)
+
+    // Private helper function to tell whether the lots currently live in the inline slots
+    bool isInline() const {
+        return spilledLots.empty();
+    }
+
+    // Private helper function to move the lots back inline once they fit again
+    void shrinkToInline() {
+        inlineCount = static_cast<uint32_t>(spilledLots.size());
+        for (uint32_t i = 0; i < inlineCount; ++i) {
+            inlineLots[i] = spilledLots[i];
+        }
+        spilledLots.clear(); // Keeps its capacity for the next delivery
+    }
+
+public:
+    // Default constructor to initialize an empty list of lots
+    LotList() : inlineLots(), inlineCount(0) {}
+
+    // Constructor to initialize an empty list whose spilled lots come from a memory resource
+    explicit LotList(pmr::memory_resource *memory) : inlineLots(), inlineCount(0), spilledLots(memory) {}
+
+    // Getter method to retrieve the number of lots
+    size_t size() const {
+        return isInline() ? inlineCount : spilledLots.size();
+    }
+
+    // Method to check whether there are no lots at all
+    bool empty() const {
+        return size() == 0;
+    }
+
+    const Lot *begin() const {
+        return isInline() ? inlineLots : spilledLots.data();
+    }
+
+    const Lot *end() const {
+        return begin() + size();
+    }
+
+    // Getter method to retrieve the lot that expires first
+    Lot &front() {
+        return isInline() ? inlineLots[0] : spilledLots.front();
+    }
+
+    const Lot &front() const {
+        return isInline() ? inlineLots[0] : spilledLots.front();
+    }
+
+    // Method to add a lot, keeping the list ordered by expiration. Lots with the same expiration date are merged
+    void add(const Lot &lot) {
+        if (isInline()) {
+            uint32_t position = 0;
+            while (position < inlineCount && inlineLots[position].expirationDate < lot.expirationDate) {
+                ++position;
+            }
+            if (position < inlineCount && inlineLots[position].expirationDate == lot.expirationDate) {
+                inlineLots[position].quantity += lot.quantity;
+                return;
+            }
+            if (inlineCount < INLINE_CAPACITY) {
+                for (uint32_t i = inlineCount; i > position; --i) {
+                    inlineLots[i] = inlineLots[i - 1];
+                }
+                inlineLots[position] = lot;
+                ++inlineCount;
+                return;
+            }
+            // The inline slots are full, so move everything to the heap before inserting
+            spilledLots.assign(inlineLots, inlineLots + inlineCount);
+            inlineCount = 0;
+        }
+
+        auto position = spilledLots.begin();
+        while (position != spilledLots.end() && position->expirationDate < lot.expirationDate) {
+            ++position;
+        }
+        if (position != spilledLots.end() && position->expirationDate == lot.expirationDate) {
+            position->quantity += lot.quantity;
+        } else {
+            spilledLots.insert(position, lot);
+        }
+    }
+
+    // Method to remove the lot that expires first
+    void popFront() {
+        if (isInline()) {
+            for (uint32_t i = 1; i < inlineCount; ++i) {
+                inlineLots[i - 1] = inlineLots[i];
+            }
+            --inlineCount;
+            return;
+        }
+        spilledLots.erase(spilledLots.begin());
+        if (spilledLots.size() <= INLINE_CAPACITY) {
+            shrinkToInline();
+        }
+    }
+
+    // Method to take a quantity out of the lots, draining the earliest-expiring lots first
+    void consume(Quantity consumedQuantity) {
+        while (consumedQuantity > 0 && !empty()) {
+            Lot &lot = front();
+            if (lot.quantity > consumedQuantity) {
+                lot.quantity -= consumedQuantity;
+                return;
+            }
+            consumedQuantity -= lot.quantity;
+            popFront();
+        }
+    }
+
+    // Method to remove every lot that has expired on the given date. Returns the quantity removed
+    Quantity removeExpired(const Date &currentDate) {
+        Quantity removedQuantity;
+        while (!empty() && currentDate >= front().expirationDate) {
+            removedQuantity += front().quantity;
+            popFront();
+        }
+        return removedQuantity;
+    }
+};
+
+// Product class represents an individual product stored in the refrigerator.
+class Product {
+private:
+    ProductId id; // The catalog id of the product; the name itself lives in the ProductCatalog
+    Quantity quantity; // The total quantity of the product in the refrigerator, summed over all lots
+    LotList lots; // The deliveries of this product, earliest expiration first
+
+public:
+    // Default constructor to initialize a product with empty values
+    Product() {
+        this->id = 0;
+        this->quantity = Quantity();
+    }
+
+    // Parametrized constructor to initialize the product with a single lot
+    Product(ProductId productId, Quantity productQuantity, const Date &productExpirationDate) {
+        this->id = productId;
+        this->quantity = productQuantity;
+        this->lots.add({productQuantity, productExpirationDate});
+    }
+
+    // Constructor to rebuild a product from its total quantity and lots (used by the product stores)
+    Product(ProductId productId, Quantity productQuantity, const LotList &productLots) {
+        this->id = productId;
+        this->quantity = productQuantity;
+        this->lots = productLots;
+    }
+
+    // Getter method to retrieve the product's catalog id
+    ProductId getId() const {
+        return id;
+    }
+
+    // Getter method to retrieve the product's quantity
+    Quantity getQuantity() const {
+        return quantity;
+    }
+
+    // Getter method to retrieve the product's earliest expiration date over all of its lots
+    Date getExpirationDate() const {
+        return lots.empty() ? Date() : lots.front().expirationDate;
+    }
+
+    // Getter method to retrieve the product's lots, earliest expiration first
+    const LotList &getLots() const {
+        return lots;
+    }
+
+    // Method to add a new delivery of the product with its own expiration date
+    void addLot(Quantity additionalQuantity, const Date &lotExpirationDate) {
+        quantity += additionalQuantity;
+        lots.add({additionalQuantity, lotExpirationDate});
+    }
+
+    // Method to consume (reduce) the quantity of the product by a specified amount,
+    // draining the earliest-expiring lots first
+    void consumeQuantity(Quantity consumedQuantity) {
+        lots.consume(consumedQuantity);
+        quantity -= consumedQuantity;
+    }
+
+    // Method to remove every lot that has expired on the given date. Returns the quantity removed
+    Quantity removeExpiredLots(const Date &currentDate) {
+        Quantity removedQuantity = lots.removeExpired(currentDate);
+        quantity -= removedQuantity;
+        return removedQuantity;
+    }
+};
+
+// Expiration sweep kernels. Each one compares `count` packed expiration days against `today` and sets
+// bit i of `mask` (64 slots per word, zeroed by the caller) when slot i has expired, i.e. days[i] <= today.
+// They return the number of expired slots. sweepExpired picks the fastest kernel the CPU supports.
+
+// Portable kernel, also used for the tail that does not fill a whole vector
+inline size_t sweepExpiredScalar(const uint32_t *days, size_t begin, size_t count, uint32_t today, uint64_t *mask) {
+    size_t expired = 0;
+    for (size_t i = begin; i < count; ++i) {
+        uint64_t bit = days[i] <= today ? 1 : 0;
+        mask[i >> 6] |= bit << (i & 63);
+        expired += bit;
+    }
+    return expired;
+}
+
+#if defined(FRIDGE_HAVE_AVX2_KERNEL)
+// AVX2 kernel: 8 dates per compare, 32 per loop iteration
+__attribute__((target("avx2"))) inline size_t sweepExpiredAvx2(const uint32_t *days, size_t count, uint32_t today,
+                                                                uint64_t *mask) {
+    const __m256i limit = _mm256_set1_epi32(static_cast<int>(today));
+    size_t expired = 0;
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        uint32_t bits = 0;
+        for (size_t lane = 0; lane < 4; ++lane) {
+            __m256i values = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(days + i + lane * 8));
+            // Unsigned days <= today exactly when max(days, today) == today
+            __m256i isExpired = _mm256_cmpeq_epi32(_mm256_max_epu32(values, limit), limit);
+            bits |= static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(isExpired))) << (lane * 8);
+        }
+        mask[i >> 6] |= static_cast<uint64_t>(bits) << (i & 63);
+        expired += static_cast<size_t>(popcount(bits));
+    }
+    return expired + sweepExpiredScalar(days, i, count, today, mask);
+}
+#endif
+
+#if defined(FRIDGE_HAVE_NEON_KERNEL)
+// NEON kernel: 4 dates per compare, 16 per loop iteration
+inline size_t sweepExpiredNeon(const uint32_t *days, size_t count, uint32_t today, uint64_t *mask) {
+    const uint32x4_t limit = vdupq_n_u32(today);
+    const uint32_t laneBitsInit[4] = {1, 2, 4, 8};
+    const uint32x4_t laneBits = vld1q_u32(laneBitsInit);
+    size_t expired = 0;
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint32_t bits = 0;
+        for (size_t lane = 0; lane < 4; ++lane) {
+            uint32x4_t isExpired = vcleq_u32(vld1q_u32(days + i + lane * 4), limit);
+            bits |= vaddvq_u32(vandq_u32(isExpired, laneBits)) << (lane * 4);
+        }
+        mask[i >> 6] |= static_cast<uint64_t>(bits) << (i & 63);
+        expired += static_cast<size_t>(popcount(bits));
+    }
+    return expired + sweepExpiredScalar(days, i, count, today, mask);
+}
+#endif
+
+// Dispatcher: resolves the kernel once (AVX2 is checked at run time) and fills `mask`, resizing it to fit
+inline size_t sweepExpired(const uint32_t *days, size_t count, uint32_t today, vector<uint64_t> &mask) {
+    mask.assign((count + 63) / 64, 0);
+#if defined(FRIDGE_HAVE_AVX2_KERNEL)
+    static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+    if (hasAvx2) {
+        return sweepExpiredAvx2(days, count, today, mask.data());
+    }
+#elif defined(FRIDGE_HAVE_NEON_KERNEL)
+    return sweepExpiredNeon(days, count, today, mask.data());
+#endif
+    return sweepExpiredScalar(days, 0, count, today, mask.data());
+}
+
+// SlotHeap is an indexed binary min-heap of store slots, ordered by one of the store's columns (ties broken
+// by product id). It remembers where every slot sits, so a slot whose key changed is moved up or down in
+// O(log n), and the k smallest slots (or those up to a key) are listed in O(k log k) by walking the heap
+// from its root without disturbing it. The keys live in the store; every call is handed the current columns
+template <typename Key>
+class SlotHeap {
+private:
+    vector<uint32_t> heap; // Slots in heap order
+    vector<uint32_t> positions; // Index into heap of every slot
+
+    static bool less(uint32_t a, uint32_t b, const Key *keys, const ProductId *ids) {
+        return keys[a] < keys[b] || (keys[a] == keys[b] && ids[a] < ids[b]);
+    }
+
+    // Private helper function to put a slot at a heap index and record its position
+    void place(size_t index, uint32_t slot) {
+        heap[index] = slot;
+        positions[slot] = static_cast<uint32_t>(index);
+    }
+
+    void siftUp(size_t index, const Key *keys, const ProductId *ids) {
+        uint32_t slot = heap[index];
+        while (index > 0) {
+            size_t parent = (index - 1) / 2;
+            if (!less(slot, heap[parent], keys, ids)) {
+                break;
+            }
+            place(index, heap[parent]);
+            index = parent;
+        }
+        place(index, slot);
+    }
+
+    void siftDown(size_t index, const Key *keys, const ProductId *ids) {
+        uint32_t slot = heap[index];
+        while (true) {
+            size_t child = 2 * index + 1;
+            if (child >= heap.size()) {
+                break;
+            }
+            if (child + 1 < heap.size() && less(heap[child + 1], heap[child], keys, ids)) {
+                ++child;
+            }
+            if (!less(heap[child], slot, keys, ids)) {
+                break;
+            }
+            place(index, heap[child]);
+            index = child;
+        }
+        place(index, slot);
+    }
+
+public:
+    void reserve(size_t count) {
+        heap.reserve(count);
+        positions.reserve(count);
+    }
+
+    // Method to add a slot; slots are added in order, so `slot` is the number of slots so far
+    void push(uint32_t slot, const Key *keys, const ProductId *ids) {
+        positions.push_back(static_cast<uint32_t>(heap.size()));
+        heap.push_back(slot);
+        siftUp(heap.size() - 1, keys, ids);
+    }
+
+    // Method to restore the order after the key of a slot changed
+    void update(uint32_t slot, const Key *keys, const ProductId *ids) {
+        size_t index = positions[slot];
+        siftUp(index, keys, ids);
+        siftDown(positions[slot], keys, ids);
+    }
+
+    // Method to remove a slot and then give the last slot its number, mirroring the store's swap-remove.
+    // The columns must still hold the removed slot's key at `slot` and the last slot's key at `last`
+    void erase(uint32_t slot, uint32_t last, const Key *keys, const ProductId *ids) {
+        size_t index = positions[slot];
+        uint32_t tail = heap.back();
+        heap.pop_back();
+        if (index < heap.size()) {
+            place(index, tail);
+            siftUp(index, keys, ids);
+            siftDown(positions[tail], keys, ids);
+        }
+        if (slot != last) {
+            heap[positions[last]] = slot;
+            positions[slot] = positions[last];
+        }
+        positions.pop_back();
+    }
+
+    // Method to call visit(slot) for the `count` smallest slots, smallest first
+    template <typename Visitor>
+    void forEachSmallest(size_t count, const Key *keys, const ProductId *ids, Visitor visit) const {
+        // Frontier of heap indexes still to visit, itself a min-heap; every visited node adds its children
+        auto later = [&](uint32_t a, uint32_t b) { return less(heap[b], heap[a], keys, ids); };
+        vector<uint32_t> frontier;
+        frontier.reserve(min(count, heap.size()) + 1);
+        if (!heap.empty()) {
+            frontier.push_back(0);
+        }
+        for (; count > 0 && !frontier.empty(); --count) {
+            pop_heap(frontier.begin(), frontier.end(), later);
+            uint32_t index = frontier.back();
+            frontier.pop_back();
+            visit(heap[index]);
+            for (uint32_t child = 2 * index + 1; child <= 2 * index + 2 && child < heap.size(); ++child) {
+                frontier.push_back(child);
+                push_heap(frontier.begin(), frontier.end(), later);
+            }
+        }
+    }
+
+    // Method to call visit(slot) for every slot whose key is at most `limit`, in heap order. Those slots
+    // form a subtree at the root of a min-heap, so the walk stops at the first larger key on every path
+    // and costs O(matches) however many slots there are. Returns false, having stopped early, once more
+    // than `budget` slots matched
+    template <typename Visitor>
+    bool forEachAtMost(Key limit, size_t budget, const Key *keys, Visitor visit) const {
+        vector<uint32_t> pending; // Heap indexes whose key is known to be at most the limit
+        if (!heap.empty() && keys[heap[0]] <= limit) {
+            pending.push_back(0);
+        }
+        for (; !pending.empty(); --budget) {
+            if (budget == 0) {
+                return false;
+            }
+            uint32_t index = pending.back();
+            pending.pop_back();
+            visit(heap[index]);
+            for (uint32_t child = 2 * index + 1; child <= 2 * index + 2 && child < heap.size(); ++child) {
+                if (keys[heap[child]] <= limit) {
+                    pending.push_back(child);
+                }
+            }
+        }
+        return true;
+    }
+};
+
+// FlatProductStore keeps the products of a refrigerator in dense parallel arrays (structure of arrays):
+// ids, total quantities and earliest expiration days sit in their own contiguous columns, so full scans
+// such as showStatus or the expiration sweep stream through memory instead of chasing hash-map nodes.
+// Products are addressed by slot; removing one moves the last slot into the hole (swap-remove), so the
+// columns never have gaps. A small open-addressing table (linear probing, backward-shift deletion)
+// maps a ProductId to its slot. If `Ordered`, two SlotHeaps also keep the slots ordered by quantity and
+// by earliest expiration, for the top-K queries; without them a product costs 16 bytes less.
+template <bool Ordered>
+class BasicFlatProductStore {
+public:
+    static constexpr uint32_t NOT_FOUND = UINT32_MAX;
+    static constexpr bool ORDERED = Ordered;
+
+private:
+    static constexpr uint32_t EMPTY_BUCKET = UINT32_MAX;
+    static constexpr size_t MIN_BUCKETS = 16;
+    static constexpr size_t DENSE_SWEEP_FRACTION = 128; // Sweep the whole column once more than 1/128 of the slots match
+
+    vector<ProductId> ids; // Catalog id of the product in each slot
+    vector<Quantity> quantities; // Total quantity of the product in each slot
+    vector<uint32_t> expirations; // Earliest lot expiration of each slot, as days since the epoch
+    vector<LotList> lots; // Lots of each slot (cold data, only touched when a product changes)
+    vector<uint32_t> buckets; // Open-addressing table holding slots, or EMPTY_BUCKET
+    uint32_t bucketShift = 64; // 64 - log2(buckets.size()), used by the Fibonacci hash
+    size_t rehashCount = 0; // Times the table was rebuilt larger
+
+    struct SlotOrder {
+        SlotHeap<Quantity> byQuantity; // Lowest stock first
+        SlotHeap<uint32_t> byExpiration; // Earliest expiration first
+    };
+    struct NoSlotOrder {};
+    [[no_unique_address]] conditional_t<Ordered, SlotOrder, NoSlotOrder> order;
+    pmr::memory_resource *memory; // Where the lot lists allocate their spilled lots
+
+    // Private helper function to get the home bucket of a product id
+    size_t homeBucket(ProductId productId) const {
+        return static_cast<size_t>((productId * 11400714819323198485ull) >> bucketShift);
+    }
+
+    // Private helper function to get the bucket that currently holds a slot
+    size_t bucketOfSlot(uint32_t slot) const {
+        size_t mask = buckets.size() - 1;
+        size_t bucket = homeBucket(ids[slot]);
+        while (buckets[bucket] != slot) {
+            bucket = (bucket + 1) & mask;
+        }
+        return bucket;
+    }
+
+    // Private helper function to rebuild the table with room for at least `count` products
+    void rehash(size_t count) {
+        size_t bucketCount = MIN_BUCKETS;
+        while (bucketCount * 3 < count * 4) {
+            bucketCount *= 2; // Keep the load factor at or below 3/4
+        }
+        if (bucketCount <= buckets.size()) {
+            return;
+        }
+
+        rehashCount += buckets.empty() ? 0 : 1; // The first allocation is not a rehash
+        buckets.assign(bucketCount, EMPTY_BUCKET);
+        bucketShift = 64;
+        for (size_t size = bucketCount; size > 1; size /= 2) {
+            --bucketShift;
+        }
+        size_t mask = bucketCount - 1;
+        for (uint32_t slot = 0; slot < ids.size(); ++slot) {
+            size_t bucket = homeBucket(ids[slot]);
+            while (buckets[bucket] != EMPTY_BUCKET) {
+                bucket = (bucket + 1) & mask;
+            }
+            buckets[bucket] = slot;
+        }
+    }
+
+    // Private helper function to empty a bucket, shifting later entries of the same probe run back into it
+    void clearBucket(size_t hole) {
+        size_t mask = buckets.size() - 1;
+        size_t next = hole;
+        while (true) {
+            next = (next + 1) & mask;
+            if (buckets[next] == EMPTY_BUCKET) {
+                break;
+            }
+            // Move the entry only if its home bucket does not lie between the hole and its current position
+            size_t home = homeBucket(ids[buckets[next]]);
+            bool homeInRange = hole <= next ? (hole < home && home <= next) : (hole < home || home <= next);
+            if (!homeInRange) {
+                buckets[hole] = buckets[next];
+                hole = next;
+            }
+        }
+        buckets[hole] = EMPTY_BUCKET;
+    }
+
+    // Private helper function to refresh the cached earliest expiration of a slot after its lots changed,
+    // and its place in the heaps
+    void refreshOrder(uint32_t slot) {
+        expirations[slot] = lots[slot].empty() ? 0 : lots[slot].front().expirationDate.getDays();
+        if constexpr (Ordered) {
+            order.byQuantity.update(slot, quantities.data(), ids.data());
+            order.byExpiration.update(slot, expirations.data(), ids.data());
+        }
+    }
+
+public:
+    // Constructor to create an empty store whose lot lists allocate from a memory resource
+    explicit BasicFlatProductStore(pmr::memory_resource *memoryResource = pmr::get_default_resource())
+        : memory(memoryResource) {}
+
+    // Getter method to retrieve the number of products stored
+    size_t size() const {
+        return ids.size();
+    }
+
+    // Method to check whether the store holds no products
+    bool empty() const {
+        return ids.empty();
+    }
+
+    // Getter methods to retrieve the size of the lookup table and how often it has grown
+    size_t getBucketCount() const {
+        return buckets.size();
+    }
+
+    size_t getRehashCount() const {
+        return rehashCount;
+    }
+
+    // Method to make room for `count` products without further reallocation
+    void reserve(size_t count) {
+        ids.reserve(count);
+        quantities.reserve(count);
+        expirations.reserve(count);
+        lots.reserve(count);
+        if constexpr (Ordered) {
+            order.byQuantity.reserve(count);
+            order.byExpiration.reserve(count);
+        }
+        rehash(count);
+    }
+
+    // Method to find the slot of a product. Returns NOT_FOUND if it is not stored
+    uint32_t find(ProductId productId) const {
+        if (buckets.empty()) {
+            return NOT_FOUND;
+        }
+        size_t mask = buckets.size() - 1;
+        for (size_t bucket = homeBucket(productId); buckets[bucket] != EMPTY_BUCKET; bucket = (bucket + 1) & mask) {
+            if (ids[buckets[bucket]] == productId) {
+                return buckets[bucket];
+            }
+        }
+        return NOT_FOUND;
+    }
+
+    // Method to add a product that is not stored yet, with a single lot. Returns its slot
+    uint32_t insert(ProductId productId, Quantity productQuantity, const Date &productExpirationDate) {
+        rehash(ids.size() + 1);
+        uint32_t slot = static_cast<uint32_t>(ids.size());
+        ids.push_back(productId);
+        quantities.push_back(productQuantity);
+        expirations.push_back(productExpirationDate.getDays());
+        lots.emplace_back(memory);
+        lots.back().add({productQuantity, productExpirationDate});
+        if constexpr (Ordered) {
+            order.byQuantity.push(slot, quantities.data(), ids.data());
+            order.byExpiration.push(slot, expirations.data(), ids.data());
+        }
+
+        size_t mask = buckets.size() - 1;
+        size_t bucket = homeBucket(productId);
+        while (buckets[bucket] != EMPTY_BUCKET) {
+            bucket = (bucket + 1) & mask;
+        }
+        buckets[bucket] = slot;
+        return slot;
+    }
+
+    // Method to remove the product in a slot. The last product moves into the freed slot
+    void erase(uint32_t slot) {
+        clearBucket(bucketOfSlot(slot));
+
+        uint32_t last = static_cast<uint32_t>(ids.size() - 1);
+        if constexpr (Ordered) {
+            order.byQuantity.erase(slot, last, quantities.data(), ids.data());
+            order.byExpiration.erase(slot, last, expirations.data(), ids.data());
+        }
+        if (slot != last) {
+            buckets[bucketOfSlot(last)] = slot;
+            ids[slot] = ids[last];
+            quantities[slot] = quantities[last];
+            expirations[slot] = expirations[last];
+            lots[slot] = move(lots[last]);
+        }
+        ids.pop_back();
+        quantities.pop_back();
+        expirations.pop_back();
+        lots.pop_back();
+    }
+
+    // Getter methods to retrieve the columns of a slot
+    ProductId getId(uint32_t slot) const {
+        return ids[slot];
+    }
+
+    Quantity getQuantity(uint32_t slot) const {
+        return quantities[slot];
+    }
+
+    Date getExpirationDate(uint32_t slot) const {
+        return Date(expirations[slot]);
+    }
+
+    const LotList &getLots(uint32_t slot) const {
+        return lots[slot];
+    }
+
+    // Getter method to retrieve the contiguous column of earliest expiration days, one entry per slot
+    const uint32_t *expirationData() const {
+        return expirations.data();
+    }
+
+    // Method to add a new delivery to the product in a slot
+    void addLot(uint32_t slot, Quantity additionalQuantity, const Date &lotExpirationDate) {
+        quantities[slot] += additionalQuantity;
+        lots[slot].add({additionalQuantity, lotExpirationDate});
+        refreshOrder(slot);
+    }
+
+    // Method to consume a quantity from the product in a slot, earliest-expiring lots first
+    void consume(uint32_t slot, Quantity consumedQuantity) {
+        lots[slot].consume(consumedQuantity);
+        quantities[slot] -= consumedQuantity;
+        refreshOrder(slot);
+    }
+
+    // Method to remove the expired lots of the product in a slot. Returns the quantity removed
+    Quantity removeExpiredLots(uint32_t slot, const Date &currentDate) {
+        Quantity removedQuantity = lots[slot].removeExpired(currentDate);
+        quantities[slot] -= removedQuantity;
+        refreshOrder(slot);
+        return removedQuantity;
+    }
+
+    // Methods to call visit(slot) for the `count` products with the lowest quantity, or with the earliest
+    // expiring lot, in that order
+    template <typename Visitor>
+    void forEachLowestQuantity(size_t count, Visitor visit) const
+        requires Ordered
+    {
+        order.byQuantity.forEachSmallest(count, quantities.data(), ids.data(), visit);
+    }
+
+    template <typename Visitor>
+    void forEachEarliestExpiration(size_t count, Visitor visit) const
+        requires Ordered
+    {
+        order.byExpiration.forEachSmallest(count, expirations.data(), ids.data(), visit);
+    }
+
+    // Method to list, in ascending order, the slots of the products with a lot expiring on or before a day.
+    // With the orderings the expiration heap yields exactly those slots in O(k log k) for k matches. Once
+    // more than 1/DENSE_SWEEP_FRACTION of the products match, or without the orderings, one vectorized
+    // sweep of the expiration column is cheaper, so the sweep marks them in `mask` (scratch space) instead
+    void findExpiring(uint32_t days, vector<uint32_t> &slots, vector<uint64_t> &mask) const {
+        slots.clear();
+        if constexpr (Ordered) {
+            if (order.byExpiration.forEachAtMost(days, ids.size() / DENSE_SWEEP_FRACTION, expirations.data(),
+                                                 [&](uint32_t slot) { slots.push_back(slot); })) {
+                sort(slots.begin(), slots.end());
+                return;
+            }
+            slots.clear();
+        }
+        slots.reserve(sweepExpired(expirations.data(), ids.size(), days, mask));
+        for (size_t word = 0; word < mask.size(); ++word) {
+            for (uint64_t bits = mask[word]; bits != 0; bits &= bits - 1) {
+                slots.push_back(static_cast<uint32_t>(word * 64 + countr_zero(bits)));
+            }
+        }
+    }
+
+    // Method to copy the product in a slot out into a standalone Product
+    Product getProduct(uint32_t slot) const {
+        return Product(ids[slot], quantities[slot], lots[slot]);
+    }
+};
+
+using FlatProductStore = BasicFlatProductStore<true>; // The default store, with the top-K orderings
+using CompactProductStore = BasicFlatProductStore<false>; // The smallest store, without them
+
+// WorkStealingPool runs tasks on a fixed set of threads. Every worker owns a task deque: it runs its own
+// newest task first, and when its deque is empty it steals the oldest task of another worker, so an
+// uneven split of work evens itself out. A thread waiting on parallelFor works on that call too instead
+// of idling.
+class WorkStealingPool {
+private:
+    struct Worker {
+        mutex lock; // Guards tasks; held only to push or pop one task
+        deque<function<void()>> tasks;
+    };
+
+    vector<unique_ptr<Worker>> workers;
+    vector<thread> threads;
+    atomic<size_t> nextWorker{0}; // Round-robin target for tasks submitted from outside the pool
+    atomic<size_t> queuedTasks{0};
+    mutex sleepLock; // Pairs with wake; idle workers sleep on it
+    condition_variable wake;
+    bool stopping = false;
+
+    static inline thread_local const WorkStealingPool *currentPool = nullptr;
+    static inline thread_local size_t currentWorker = 0;
+
+    // Private helper function to run one task, preferring the given worker's own deque. Returns false if
+    // no task was found anywhere
+    bool runOne(size_t self) {
+        function<void()> task;
+        size_t count = workers.size();
+        for (size_t offset = 0; offset < count && !task; ++offset) {
+            Worker &worker = *workers[(self + offset) % count];
+            lock_guard<mutex> guard(worker.lock);
+            if (worker.tasks.empty()) {
+                continue;
+            }
+            if (offset == 0) {
+                task = move(worker.tasks.back()); // Own work: newest first, while its data is still in cache
+                worker.tasks.pop_back();
+            } else {
+                task = move(worker.tasks.front()); // Stolen work: oldest first, which tends to be the largest
+                worker.tasks.pop_front();
+            }
+        }
+        if (!task) {
+            return false;
+        }
+        queuedTasks.fetch_sub(1, memory_order_relaxed);
+        task();
+        return true;
+    }
+
+    // Private helper function run by every worker thread
+    void workerLoop(size_t self) {
+        currentPool = this;
+        currentWorker = self;
+        while (true) {
+            if (runOne(self)) {
+                continue;
+            }
+            unique_lock<mutex> sleeping(sleepLock);
+            wake.wait(sleeping, [&] { return stopping || queuedTasks.load(memory_order_relaxed) > 0; });
+            if (stopping && queuedTasks.load(memory_order_relaxed) == 0) {
+                return;
+            }
+        }
+    }
+
+public:
+    // Constructor to start `threadCount` workers (one per hardware thread if zero)
+    explicit WorkStealingPool(size_t threadCount = 0) {
+        if (threadCount == 0) {
+            threadCount = max<size_t>(1, thread::hardware_concurrency());
+        }
+        for (size_t i = 0; i < threadCount; ++i) {
+            workers.push_back(make_unique<Worker>());
+        }
+        for (size_t i = 0; i < threadCount; ++i) {
+            threads.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    // Destructor to finish the queued tasks and stop the workers
+    ~WorkStealingPool() {
+        {
+            lock_guard<mutex> guard(sleepLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread &worker : threads) {
+            worker.join();
+        }
+    }
+
+    // Getter method to retrieve the number of worker threads
+    size_t getWorkerCount() const {
+        return workers.size();
+    }
+
+    // Method to queue a task. A task submitted by a worker goes to that worker's own deque
+    void submit(function<void()> task) {
+        size_t target = currentPool == this ? currentWorker
+                                            : nextWorker.fetch_add(1, memory_order_relaxed) % workers.size();
+        {
+            lock_guard<mutex> guard(workers[target]->lock);
+            workers[target]->tasks.push_back(move(task));
+        }
+        {
+            lock_guard<mutex> guard(sleepLock); // Counted under the lock so a worker about to sleep sees it
+            queuedTasks.fetch_add(1, memory_order_relaxed);
+        }
+        wake.notify_one();
+    }
+
+    // Method to call body(index, slot) for every index in [0, count) and wait for all of them. `slot` is
+    // below getWorkerCount() + 1 and no two calls running at the same time share one, so it can pick a
+    // per-thread partial result without locking. The first exception thrown by body is rethrown here.
+    // Any number of threads may call it at once: a caller from outside the pool gets the last slot for
+    // its own call and never runs the chunks of another call, where that slot could already be taken
+    template <typename Body>
+    void parallelFor(size_t count, Body body) {
+        if (count == 0) {
+            return;
+        }
+        bool inPool = currentPool == this;
+        size_t callerSlot = inPool ? currentWorker : workers.size();
+        size_t chunkSize = max<size_t>(1, count / (workers.size() * 8)); // Enough chunks for stealing to balance
+        size_t chunkCount = (count + chunkSize - 1) / chunkSize;
+        atomic<size_t> nextChunk{0}; // Chunks are claimed in order by whichever thread gets there first
+        atomic<size_t> remaining{chunkCount}; // Tasks not finished yet
+        mutex errorLock;
+        exception_ptr error;
+
+        // Function to claim and run the next chunk under `slot`. Returns false once every chunk is claimed
+        auto runChunk = [&](size_t slot) {
+            size_t chunk = nextChunk.fetch_add(1, memory_order_relaxed);
+            if (chunk >= chunkCount) {
+                return false;
+            }
+            size_t end = min(count, (chunk + 1) * chunkSize);
+            try {
+                for (size_t index = chunk * chunkSize; index < end; ++index) {
+                    body(index, slot);
+                }
+            } catch (...) {
+                lock_guard<mutex> guard(errorLock);
+                if (!error) {
+                    error = current_exception();
+                }
+            }
+            return true;
+        };
+
+        // One task per chunk, each running whichever chunk is next; only workers run tasks, under their own slot
+        for (size_t chunk = 0; chunk < chunkCount; ++chunk) {
+            submit([&] {
+                runChunk(currentWorker);
+                remaining.fetch_sub(1, memory_order_acq_rel);
+            });
+        }
+        while (runChunk(callerSlot)) {
+        }
+
+        // The tasks reference this frame, so it must not return before all of them ran (the ones left once
+        // the caller took the last chunk are empty). A worker runs other tasks meanwhile
+        while (remaining.load(memory_order_acquire) != 0) {
+            if (!inPool || !runOne(callerSlot)) {
+                this_thread::yield();
+            }
+        }
+        if (error) {
+            rethrow_exception(error);
+        }
+    }
+};
+
+// Kinds of actions that can be recorded in the refrigerator history
+enum class ActionType : uint8_t {
+    Insert,
+    Consume
+};
+
+// A single typed entry of the history log. The product is stored as an interned id,
+// so no string is built when the action happens; text is produced only when printing.
+struct HistoryEvent {
+    Quantity quantity; // The quantity inserted or consumed
+    ProductId productId; // Catalog id of the product
+    uint32_t timestamp; // Seconds since the Unix epoch when the action was recorded
+    ActionType type; // The kind of action performed
+};
+
+// HistoryLog holds the raw history events. Without a capacity it is a plain append-only log; with one
+// it becomes a ring of the most recent events that hands every event it drops back to the caller
+class HistoryLog {
+private:
+    pmr::vector<HistoryEvent> events;
+    size_t capacity = 0; // Most events kept (0 keeps all)
+    size_t oldest = 0; // Index of the oldest event once the ring has wrapped
+
+public:
+    explicit HistoryLog(pmr::memory_resource *memory = pmr::get_default_resource()) : events(memory) {}
+
+    size_t size() const {
+        return events.size();
+    }
+
+    bool empty() const {
+        return events.empty();
+    }
+
+    size_t getCapacity() const {
+        return capacity;
+    }
+
+    // Method to make room for `count` more events (never beyond the capacity)
+    void reserve(size_t count) {
+        size_t wanted = events.size() + count;
+        events.reserve(capacity == 0 ? wanted : min(wanted, capacity));
+    }
+
+    // Method to append an event. Returns true, with the dropped event in `evicted`, if the ring was full
+    bool push(const HistoryEvent &event, HistoryEvent &evicted) {
+        if (capacity == 0 || events.size() < capacity) {
+            events.push_back(event);
+            return false;
+        }
+        evicted = events[oldest];
+        events[oldest] = event;
+        oldest = (oldest + 1) % capacity;
+        return true;
+    }
+
+    // Method to change the capacity, calling evict(event) for every event dropped, oldest first
+    template <typename Evict>
+    void setCapacity(size_t newCapacity, Evict evict) {
+        rotate(events.begin(), events.begin() + static_cast<ptrdiff_t>(oldest), events.end()); // Oldest first again
+        oldest = 0;
+        capacity = newCapacity;
+        if (capacity == 0 || events.size() <= capacity) {
+            return;
+        }
+        size_t dropped = events.size() - capacity;
+        for (size_t i = 0; i < dropped; ++i) {
+            evict(events[i]);
+        }
+        events.erase(events.begin(), events.begin() + static_cast<ptrdiff_t>(dropped));
+        events.shrink_to_fit();
+    }
+
+    // Method to call visit(event) for every event, oldest first
+    template <typename Visitor>
+    void forEach(Visitor visit) const {
+        for (size_t i = oldest; i < events.size(); ++i) {
+            visit(events[i]);
+        }
+        for (size_t i = 0; i < oldest; ++i) {
+            visit(events[i]);
+        }
+    }
+
+    // Getter method to retrieve the events as stored, which is not oldest first once the ring has wrapped.
+    // For passes whose result does not depend on the order, such as splitting the log between threads
+    span<const HistoryEvent> getEvents() const {
+        return events;
+    }
+};
+
+// Totals of the history events of one product on one day, kept once the raw events are dropped
+struct HistoryDaySummary {
+    uint32_t day = 0; // Days since the Unix epoch
+    ProductId productId = 0;
+    Quantity inserted;
+    Quantity consumed;
+    uint32_t insertCount = 0;
+    uint32_t consumeCount = 0;
+};
+
+// How much history a refrigerator keeps (see Refrigerator::setHistoryRetention)
+struct HistoryRetention {
+    size_t rawEvents = 0; // Most recent events kept as they are; older ones are rolled into daily summaries (0 keeps all)
+    uint32_t summaryDays = 0; // Days of daily summaries kept, counted back from the newest (0 keeps all)
+    bool spillToStorage = false; // Also append every rolled-up event to the attached storage's history archive
+};
+
+// Outcome of a single insert or consume operation
+enum class OperationStatus : uint8_t {
+    Ok,
+    NonPositiveQuantity, // The quantity to insert or consume was zero or negative
+    ProductNotFound, // The product to consume is not in the refrigerator
+    NotEnoughQuantity, // The refrigerator holds less of the product than was asked for
+    InvalidQuantity, // The quantity was made from a number that does not fit (see Quantity::isRepresentable)
+    QuantityOverflow // The insert would take the product's total past the largest quantity that can be held
+};
+
+// One row of a bulk insertion (see Refrigerator::insertBatch). The name may point into the
+// caller's buffer; it only has to stay valid for the duration of the call
+struct InsertRecord {
+    string_view productName;
+    Quantity quantity;
+    Date expirationDate;
+};
+
+// One row of a bulk consumption (see Refrigerator::consumeBatch)
+struct ConsumeRecord {
+    string_view productName;
+    Quantity quantity;
+};
+
+// Quantity per product id, allocated from a refrigerator's memory resource
+using QuantityMap = pmr::unordered_map<ProductId, Quantity>;
+
+// Consumption recorded during a single day, one slot of the time-windowed ring
+struct ConsumptionBucket {
+    uint32_t day = 0; // Day number (days since the Unix epoch) this bucket currently holds
+    QuantityMap consumed; // Quantity consumed per product id on that day
+
+    explicit ConsumptionBucket(pmr::memory_resource *memory) : consumed(memory) {}
+};
+
+// Counts returned by a bulk purge of expired lots (see Refrigerator::purgeExpired)
+struct PurgeCounts {
+    size_t products = 0; // Products that had expired lots
+    size_t removedProducts = 0; // Of those, the products with nothing left, which were removed
+    Quantity quantity; // Total quantity removed
+
+    PurgeCounts &operator+=(const PurgeCounts &other) {
+        products += other.products;
+        removedProducts += other.removedProducts;
+        quantity += other.quantity;
+        return *this;
+    }
+};
+
+// Exponentially weighted consumption of one product, kept as a decayed sum so a consumption updates it
+// in O(1): every day the sum shrinks by the retention factor 1 - alpha, and each consumption adds
+// alpha * quantity. Read on a given day (and divided by the weight of the days seen so far) it is the
+// smoothed daily consumption rate
+struct ConsumptionRate {
+    double decayedSum = 0;
+    uint32_t firstDay = 0; // Day of the earliest consumption folded in
+    uint32_t lastDay = 0; // Day decayedSum is valid for
+};
+
+// Parameters of the forecasting shopping list (see Refrigerator::forecastReorders)
+struct ForecastPolicy {
+    double halfLifeDays = 7; // Age at which a day's consumption counts half as much as today's
+    uint32_t leadTimeDays = 2; // Days from ordering to delivery
+    uint32_t safetyDays = 1; // Reorder when the usable stock lasts less than the lead time plus this
+    uint32_t coverDays = 7; // Days of consumption after the delivery that an order should cover
+};
+
+// One product the forecast suggests reordering
+struct ReorderSuggestion {
+    ProductId productId;
+    string_view name;
+    double dailyRate; // Smoothed consumption per day
+    double usableStock; // Stock that will be used before it expires, within the forecast horizon
+    double coverageDays; // Days the usable stock lasts at the daily rate
+    double orderQuantity; // Suggested quantity to order
+};
+
+// When a ReportWriter hands its buffered text to the output stream
+enum class FlushPolicy : uint8_t {
+    PerReport, // Write and flush once at the end of every report (interactive use)
+    Manual // Keep appending until flush() is called (batch jobs that print many reports)
+};
+
+// ReportWriter formats report text into one reusable character buffer (numbers via to_chars, no locale)
+// and hands it to the output stream in a single write, instead of flushing the stream after every line.
+class ReportWriter {
+private:
+    string buffer; // Pending text; its capacity is kept between reports
+    ostream *output; // Where finished reports are written
+    FlushPolicy policy; // When the buffer is written out
+
+    // Private helper function to append a number formatted by to_chars
+    template <typename... Options>
+    void appendNumber(double value, Options... options) {
+        char digits[64];
+        auto result = to_chars(digits, digits + sizeof(digits), value, options...);
+        buffer.append(digits, result.ptr);
+    }
+
+public:
+    // Constructor to write to a stream (standard output by default) with a given flush policy
+    explicit ReportWriter(ostream &stream = cout, FlushPolicy flushPolicy = FlushPolicy::PerReport)
+        : output(&stream), policy(flushPolicy) {
+        buffer.reserve(4096);
+    }
+
+    // Method to redirect the reports to another stream. Pending text is written to the old stream first
+    void setOutput(ostream &stream) {
+        flush();
+        output = &stream;
+    }
+
+    // Method to change when the buffer is written out
+    void setFlushPolicy(FlushPolicy flushPolicy) {
+        policy = flushPolicy;
+    }
+
+    // Method to turn the synchronization of the C++ standard streams with C stdio on or off.
+    // Turning it off lets cout buffer on its own; call it before anything has been printed
+    static void setStreamSync(bool synchronized) {
+        ios::sync_with_stdio(synchronized);
+    }
+
+    ReportWriter &operator<<(string_view text) {
+        buffer.append(text);
+        return *this;
+    }
+
+    ReportWriter &operator<<(char character) {
+        buffer.push_back(character);
+        return *this;
+    }
+
+    // Doubles are printed like an ostream with default settings does (%g, 6 significant digits)
+    ReportWriter &operator<<(double value) {
+        appendNumber(value, chars_format::general, 6);
+        return *this;
+    }
+
+    ReportWriter &operator<<(uint64_t value) {
+        char digits[24];
+        auto result = to_chars(digits, digits + sizeof(digits), value);
+        buffer.append(digits, result.ptr);
+        return *this;
+    }
+
+    ReportWriter &operator<<(uint32_t value) {
+        return *this << static_cast<uint64_t>(value);
+    }
+
+    // Quantities are printed exactly: the whole units, then the thousandths with trailing zeros dropped
+    ReportWriter &operator<<(const Quantity &quantity) {
+        int64_t milliUnits = quantity.getMilliUnits();
+        uint64_t magnitude = milliUnits < 0 ? 0 - static_cast<uint64_t>(milliUnits) : static_cast<uint64_t>(milliUnits);
+        if (milliUnits < 0) {
+            buffer.push_back('-');
+        }
+        *this << magnitude / Quantity::SCALE;
+        uint64_t fraction = magnitude % Quantity::SCALE;
+        if (fraction != 0) {
+            char digits[4] = {'.', static_cast<char>('0' + fraction / 100), static_cast<char>('0' + fraction / 10 % 10),
+                              static_cast<char>('0' + fraction % 10)};
+            size_t length = sizeof(digits);
+            while (digits[length - 1] == '0') {
+                --length;
+            }
+            buffer.append(digits, length);
+        }
+        return *this;
+    }
+
+    ReportWriter &operator<<(const Date &date) {
+        buffer.append(date.toString());
+        return *this;
+    }
+
+    // Method to append a double with a fixed number of decimals (like to_string or %f)
+    ReportWriter &fixed(double value, int decimals = 6) {
+        appendNumber(value, chars_format::fixed, decimals);
+        return *this;
+    }
+
+    // Method to mark the end of a report; it is written out now under the PerReport policy
+    void endReport() {
+        if (policy == FlushPolicy::PerReport) {
+            flush();
+        }
+    }
+
+    // Method to write all pending text to the stream in one call and flush it
+    void flush() {
+        if (!buffer.empty()) {
+            output->write(buffer.data(), static_cast<streamsize>(buffer.size()));
+            buffer.clear();
+        }
+        output->flush();
+    }
+
+    ~ReportWriter() {
+        flush();
+    }
+};
+
+// Function to convert a number or enum between host and little-endian byte order (a no-op on
+// little-endian hosts), so the logs and the network protocol read the same on any machine
+template <typename T>
+T littleEndian(T value) {
+    static_assert(is_arithmetic_v<T> || is_enum_v<T>, "only numbers and enums have a byte order");
+    if constexpr (endian::native == endian::big && sizeof(T) > 1) {
+        char raw[sizeof(T)];
+        memcpy(raw, &value, sizeof(T));
+        reverse(raw, raw + sizeof(T));
+        memcpy(&value, raw, sizeof(T));
+    }
+    return value;
+}
+
+// BinaryWriter appends fixed-size values (little-endian, whatever the host) and length-prefixed strings
+// to a byte buffer
+class BinaryWriter {
+private:
+    string bytes; // Encoded data; its capacity is kept across clear()
+
+public:
+    template <typename T>
+    void put(T value) {
+        value = littleEndian(value);
+        bytes.append(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    void putString(string_view text) {
+        put(static_cast<uint32_t>(text.size()));
+        bytes.append(text);
+    }
+
+    void putBytes(string_view raw) {
+        bytes.append(raw);
+    }
+
+    // Method to overwrite a value put earlier at `offset`, such as a count only known once the items are written
+    template <typename T>
+    void putAt(size_t offset, T value) {
+        value = littleEndian(value);
+        memcpy(bytes.data() + offset, &value, sizeof(T));
+    }
+
+    const string &getBytes() const {
+        return bytes;
+    }
+
+    size_t size() const {
+        return bytes.size();
+    }
+
+    void clear() {
+        bytes.clear();
+    }
+};
+
+// BinaryReader reads back what a BinaryWriter wrote. Every read is bounds checked and returns false
+// once the data runs out, so a truncated file is detected instead of read past its end
+class BinaryReader {
+private:
+    string_view bytes; // The data being read
+    size_t offset = 0; // Position of the next read
+
+public:
+    explicit BinaryReader(string_view data) : bytes(data) {}
+
+    template <typename T>
+    bool get(T &value) {
+        if (bytes.size() - offset < sizeof(T)) {
+            return false;
+        }
+        memcpy(&value, bytes.data() + offset, sizeof(T));
+        value = littleEndian(value);
+        offset += sizeof(T);
+        return true;
+    }
+
+    bool getString(string_view &text) {
+        uint32_t length = 0;
+        if (!get(length) || bytes.size() - offset < length) {
+            return false;
+        }
+        text = bytes.substr(offset, length);
+        offset += length;
+        return true;
+    }
+
+    bool skip(size_t count) {
+        if (bytes.size() - offset < count) {
+            return false;
+        }
+        offset += count;
+        return true;
+    }
+
+    size_t getOffset() const {
+        return offset;
+    }
+
+    size_t remaining() const {
+        return bytes.size() - offset;
+    }
+};
+
+// Function to compute a 32-bit FNV-1a checksum, used to detect torn or corrupted records on disk
+inline uint32_t checksum32(string_view bytes) {
+    uint32_t hashValue = 2166136261u;
+    for (char c : bytes) {
+        hashValue = (hashValue ^ static_cast<uint8_t>(c)) * 16777619u;
+    }
+    return hashValue;
+}
+
+// --- Snapshot file layout ---
+// A snapshot is a flat, versioned image that can be mmap-ed and queried in place. All sections are
+// 8-byte aligned arrays of the fixed-size rows below, located by the offsets in the header; names live
+// in one blob at the end and rows refer to them by offset and length. Products are sorted by name,
+// so a reader can binary-search a product without building any map. Being read in place, the rows are
+// in host byte order (unlike the logs, which BinaryWriter keeps little-endian).
+//
+//   [SnapshotHeader][SnapshotProduct x productCount][SnapshotLot x lotCount]
+//   [SnapshotConsumption x consumedCount][SnapshotBucket x bucketCount]
+//   [SnapshotConsumption x bucketEntryCount][name blob]
+
+struct SnapshotHeader {
+    char magic[8]; // "FRIDGESN"
+    uint32_t version; // SNAPSHOT_VERSION
+    uint32_t checksum; // checksum32 of everything after the header
+    uint64_t sequence; // Last WAL sequence number contained in the snapshot
+    uint64_t fileSize; // Total size of the file, to detect truncation
+    uint64_t productsOffset, lotsOffset, consumedOffset, bucketsOffset, bucketEntriesOffset, namesOffset;
+    uint32_t productCount, lotCount, consumedCount, bucketCount, bucketEntryCount, namesSize;
+};
+
+// One product: its name, its lots (a range of the lot section) and its cached totals
+struct SnapshotProduct {
+    uint32_t nameOffset, nameLength; // Name, in the name blob
+    uint32_t firstLot, lotCount; // Lots, earliest expiration first
+    int64_t quantity; // Total quantity over all lots, in milli-units (quantities are stored exactly, as Quantity)
+    uint32_t expirationDays; // Earliest lot expiration
+    uint32_t reserved;
+};
+
+struct SnapshotLot {
+    int64_t quantity; // Milli-units
+    uint32_t expirationDays;
+    uint32_t reserved;
+};
+
+// A consumed quantity of a named product (running totals and per-day bucket entries)
+struct SnapshotConsumption {
+    uint32_t nameOffset, nameLength;
+    int64_t quantity; // Milli-units
+};
+
+// One day of the consumption ring: a range of the bucket entry section
+struct SnapshotBucket {
+    uint32_t day;
+    uint32_t firstEntry, entryCount;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(SnapshotHeader) == 104 && sizeof(SnapshotProduct) == 32 && sizeof(SnapshotLot) == 16 &&
+                  sizeof(SnapshotConsumption) == 16 && sizeof(SnapshotBucket) == 16,
+              "snapshot rows are written to disk as-is and must not change size");
+
+constexpr char SNAPSHOT_MAGIC[8] = {'F', 'R', 'I', 'D', 'G', 'E', 'S', 'N'};
+constexpr uint32_t SNAPSHOT_VERSION = 3; // Version 2 stored quantities as f64
+
+// MappedSnapshot maps a snapshot file read-only and answers queries straight from the mapped pages,
+// so opening even a large inventory costs only the mmap, and several reporting processes reading the
+// same file share one copy in the page cache.
+class MappedSnapshot {
+public:
+    static constexpr uint32_t NOT_FOUND = UINT32_MAX;
+
+private:
+    const char *data = nullptr; // Start of the mapping
+    size_t size = 0; // Length of the mapping
+    const SnapshotHeader *header = nullptr;
+    string lastError;
+
+    // Private helper function to get a typed section of the mapping
+    template <typename Row>
+    const Row *section(uint64_t offset) const {
+        return reinterpret_cast<const Row *>(data + offset);
+    }
+
+    // Private helper function to check that `count` rows of a section fit in the file
+    bool sectionFits(uint64_t offset, uint64_t count, uint64_t rowSize) const {
+        return offset % 8 == 0 && offset <= size && count <= (size - offset) / rowSize;
+    }
+
+    // Private helper function to resolve a name stored in the blob (empty if out of bounds)
+    string_view name(uint32_t offset, uint32_t length) const {
+        if (offset > header->namesSize || length > header->namesSize - offset) {
+            return string_view();
+        }
+        return string_view(data + header->namesOffset + offset, length);
+    }
+
+    bool fail(const string &message) {
+        lastError = message;
+        close();
+        return false;
+    }
+
+public:
+    MappedSnapshot() = default;
+    MappedSnapshot(const MappedSnapshot &) = delete;
+    MappedSnapshot &operator=(const MappedSnapshot &) = delete;
+
+    ~MappedSnapshot() {
+        close();
+    }
+
+    // Method to map a snapshot file. The layout is validated in constant time; verifying the checksum
+    // reads every page, so read-only reporters that trust the file can skip it.
+    // Returns false (see getLastError) if the file is missing, of another version, or damaged
+    bool open(const string &path, bool verifyChecksum = true) {
+        close();
+        int descriptor = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (descriptor < 0) {
+            return fail("cannot open " + path + ": " + strerror(errno));
+        }
+        struct stat status;
+        if (::fstat(descriptor, &status) != 0 || status.st_size < static_cast<off_t>(sizeof(SnapshotHeader))) {
+            ::close(descriptor);
+            return fail(path + " is not a snapshot");
+        }
+        size = static_cast<size_t>(status.st_size);
+        void *mapping = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, descriptor, 0);
+        ::close(descriptor); // The mapping keeps the file referenced
+        if (mapping == MAP_FAILED) {
+            size = 0;
+            return fail("cannot map " + path + ": " + strerror(errno));
+        }
+        data = static_cast<const char *>(mapping);
+        header = reinterpret_cast<const SnapshotHeader *>(data);
+
+        if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || header->version != SNAPSHOT_VERSION) {
+            return fail(path + " is not a version " + to_string(SNAPSHOT_VERSION) + " snapshot");
+        }
+        if (header->fileSize != size || !sectionFits(header->productsOffset, header->productCount, sizeof(SnapshotProduct)) ||
+            !sectionFits(header->lotsOffset, header->lotCount, sizeof(SnapshotLot)) ||
+            !sectionFits(header->consumedOffset, header->consumedCount, sizeof(SnapshotConsumption)) ||
+            !sectionFits(header->bucketsOffset, header->bucketCount, sizeof(SnapshotBucket)) ||
+            !sectionFits(header->bucketEntriesOffset, header->bucketEntryCount, sizeof(SnapshotConsumption)) ||
+            !sectionFits(header->namesOffset, header->namesSize, 1)) {
+            return fail(path + " is truncated or damaged");
+        }
+        if (verifyChecksum &&
+            checksum32(string_view(data + sizeof(SnapshotHeader), size - sizeof(SnapshotHeader))) != header->checksum) {
+            return fail(path + " is corrupted");
+        }
+        return true;
+    }
+
+    // Method to unmap the file
+    void close() {
+        if (data != nullptr) {
+            ::munmap(const_cast<char *>(data), size);
+        }
+        data = nullptr;
+        header = nullptr;
+        size = 0;
+    }
+
+    bool isOpen() const {
+        return header != nullptr;
+    }
+
+    const string &getLastError() const {
+        return lastError;
+    }
+
+    // Getter method to retrieve the last WAL sequence number the snapshot contains
+    uint64_t getSequence() const {
+        return header->sequence;
+    }
+
+    // Getter methods to read the product table, in name order
+    uint32_t getProductCount() const {
+        return header->productCount;
+    }
+
+    string_view getProductName(uint32_t index) const {
+        const SnapshotProduct &product = section<SnapshotProduct>(header->productsOffset)[index];
+        return name(product.nameOffset, product.nameLength);
+    }
+
+    Quantity getQuantity(uint32_t index) const {
+        return Quantity::fromMilliUnits(section<SnapshotProduct>(header->productsOffset)[index].quantity);
+    }
+
+    Date getExpirationDate(uint32_t index) const {
+        return Date(section<SnapshotProduct>(header->productsOffset)[index].expirationDays);
+    }
+
+    // Getter method to retrieve the lots of a product, earliest expiration first (empty if damaged)
+    span<const SnapshotLot> getLots(uint32_t index) const {
+        const SnapshotProduct &product = section<SnapshotProduct>(header->productsOffset)[index];
+        if (product.firstLot > header->lotCount || product.lotCount > header->lotCount - product.firstLot) {
+            return {};
+        }
+        return span<const SnapshotLot>(section<SnapshotLot>(header->lotsOffset) + product.firstLot, product.lotCount);
+    }
+
+    // Method to find a product by name with a binary search. Returns NOT_FOUND if it is not there
+    uint32_t find(string_view productName) const {
+        uint32_t low = 0, high = header->productCount;
+        while (low < high) {
+            uint32_t middle = low + (high - low) / 2;
+            if (getProductName(middle) < productName) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        return low < header->productCount && getProductName(low) == productName ? low : NOT_FOUND;
+    }
+
+    // Getter methods to read the consumption running totals
+    uint32_t getConsumedCount() const {
+        return header->consumedCount;
+    }
+
+    string_view getConsumedName(uint32_t index) const {
+        const SnapshotConsumption &entry = section<SnapshotConsumption>(header->consumedOffset)[index];
+        return name(entry.nameOffset, entry.nameLength);
+    }
+
+    Quantity getConsumedQuantity(uint32_t index) const {
+        return Quantity::fromMilliUnits(section<SnapshotConsumption>(header->consumedOffset)[index].quantity);
+    }
+
+    // Getter methods to read the daily consumption buckets
+    uint32_t getBucketCount() const {
+        return header->bucketCount;
+    }
+
+    uint32_t getBucketDay(uint32_t bucket) const {
+        return section<SnapshotBucket>(header->bucketsOffset)[bucket].day;
+    }
+
+    // Method to call visit(name, quantity) for every entry of a daily bucket
+    template <typename Visitor>
+    void forEachBucketEntry(uint32_t bucket, Visitor visit) const {
+        const SnapshotBucket &row = section<SnapshotBucket>(header->bucketsOffset)[bucket];
+        if (row.firstEntry > header->bucketEntryCount || row.entryCount > header->bucketEntryCount - row.firstEntry) {
+            return;
+        }
+        const SnapshotConsumption *entries = section<SnapshotConsumption>(header->bucketEntriesOffset) + row.firstEntry;
+        for (uint32_t i = 0; i < row.entryCount; ++i) {
+            visit(name(entries[i].nameOffset, entries[i].nameLength), Quantity::fromMilliUnits(entries[i].quantity));
+        }
+    }
+};
+
+// Kinds of records stored in the write-ahead log
+enum class WalRecordType : uint8_t {
+    Insert = 1, // A delivery: name, quantity and expiration date
+    Consume = 2, // A consumption: name and quantity
+    Purge = 3 // A checkExpirations run that removed lots: the date it was run for
+};
+
+// Compile-time policies of a BasicRefrigerator. Store: FlatStore keeps the top-K orderings,
+// CompactStore leaves them out
+struct FlatStore {
+    using Store = FlatProductStore;
+};
+
+struct CompactStore {
+    using Store = CompactProductStore;
+};
+
+// History: FullHistory keeps the action log, the consumption aggregates behind the shopping lists and the
+// action listener; NoHistory keeps none of them, so an update only touches the store
+struct FullHistory {
+    static constexpr bool ENABLED = true;
+};
+
+struct NoHistory {
+    static constexpr bool ENABLED = false;
+};
+
+// Locking: NoLock for a refrigerator used by one thread at a time, SharedLock to let any number of
+// threads call it (readers share the lock, updates and reports take it exclusively)
+struct NoLock {
+    struct Mutex {
+        void lock() {}
+        void unlock() {}
+        void lock_shared() {}
+        void unlock_shared() {}
+    };
+};
+
+struct SharedLock {
+    using Mutex = shared_mutex;
+};
+
+template <typename StorePolicy = FlatStore, typename HistoryPolicy = FullHistory, typename LockPolicy = NoLock>
+class BasicRefrigerator;
+
+// The full-featured refrigerator used by the program, its storage, fleets and the concurrent front ends
+using Refrigerator = BasicRefrigerator<>;
+
+// FridgeStorage makes a Refrigerator durable. Every successful insert, consume and expiration purge is
+// appended to a write-ahead log (WAL); records are buffered and written plus fsync'ed together once per
+// public operation, so a whole batch costs a single fsync (group commit). Every `snapshotInterval`
+// records the full state is written to a snapshot and the WAL is emptied, so opening the storage is a
+// snapshot load plus a short WAL replay.
+//
+// Files in the data directory:
+//   fridge.snapshot  products with their lots and the consumption tallies in the flat layout read by
+//                    MappedSnapshot, written atomically (temp + rename)
+//   fridge.wal       records since the snapshot: [checksum u32][size u32][payload], payload =
+//                    [sequence u64][type u8][timestamp u32][quantity i64][expiration days u32][name]
+//   fridge.history   the history archive, records of the same framing with the payload
+//                    [type u8][timestamp u32][quantity i64][name]
+// Quantities are Quantity milli-units, so nothing goes through floating point on the way to disk and
+// back. Both logs start with a header, [magic 8 bytes][LOG_VERSION u32], kept when the WAL is emptied;
+// files of another version (version 1 had no header and f64 quantities) are refused rather than misread.
+//
+// Records carry increasing sequence numbers and the snapshot stores the last one it contains, so after
+// a crash between writing a snapshot and emptying the WAL nothing is applied twice. Replay stops at the
+// first torn or corrupted record and cuts the log there.
+class FridgeStorage {
+private:
+    static constexpr char WAL_MAGIC[8] = {'F', 'R', 'I', 'D', 'G', 'E', 'W', 'L'};
+    static constexpr char ARCHIVE_MAGIC[8] = {'F', 'R', 'I', 'D', 'G', 'E', 'H', 'A'};
+    static constexpr uint32_t LOG_VERSION = 2;
+    static constexpr size_t LOG_HEADER_BYTES = sizeof(WAL_MAGIC) + sizeof(LOG_VERSION);
+    static constexpr size_t BATCH_COMMIT_BYTES = 1 << 20; // Pending bytes that force a write while commits are batched
+    static constexpr size_t TALLY_CHUNK_BYTES = 4 << 20; // Archive bytes checked and summed by one task of a parallel tally
+
+    string directory; // Directory holding the WAL and snapshot
+    size_t snapshotInterval; // WAL records between automatic snapshots (0 disables them)
+    bool batchCommits = false; // Whether commit() waits for BATCH_COMMIT_BYTES (see setBatchCommits)
+    int walDescriptor = -1; // Open WAL file, appended to
+    BinaryWriter pending; // Records appended since the last commit
+    BinaryWriter payload; // Scratch buffer for encoding one record
+    size_t pendingRecords = 0;
+    int archiveDescriptor = -1; // Open history archive, appended to
+    BinaryWriter pendingArchive; // History events spilled since the last commit
+    size_t walRecords = 0; // Records in the WAL file since the last snapshot
+    size_t replayedRecords = 0; // Records replayed by open()
+    uint64_t lastSequence = 0; // Sequence number of the last record appended
+    Refrigerator *fridge = nullptr; // The refrigerator being persisted, set by open()
+    string lastError;
+
+    string walPath() const {
+        return directory + "/fridge.wal";
+    }
+
+    string snapshotPath() const {
+        return directory + "/fridge.snapshot";
+    }
+
+    string archivePath() const {
+        return directory + "/fridge.history";
+    }
+
+    // Private helper function to remember why an operation failed
+    bool fail(const string &message) {
+        lastError = message + ": " + strerror(errno);
+        return false;
+    }
+
+    // Private helper function to write a whole buffer, retrying on short writes
+    static bool writeAll(int descriptor, const string &bytes) {
+        size_t written = 0;
+        while (written < bytes.size()) {
+            ssize_t result = ::write(descriptor, bytes.data() + written, bytes.size() - written);
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            written += static_cast<size_t>(result);
+        }
+        return true;
+    }
+
+    // Private helper function to read a whole file. A missing file reads as empty
+    static bool readFile(const string &path, string &contents) {
+        ifstream file(path, ios::binary);
+        if (!file) {
+            contents.clear();
+            return errno == ENOENT;
+        }
+        contents.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+        return !file.bad();
+    }
+
+    // Private helper function to encode one record into the pending buffer
+    void appendRecord(WalRecordType type, uint32_t timestamp, Quantity quantity, uint32_t expirationDays,
+                      string_view productName) {
+        payload.clear();
+        payload.put(++lastSequence);
+        payload.put(type);
+        payload.put(timestamp);
+        payload.put(quantity.getMilliUnits());
+        payload.put(expirationDays);
+        payload.putString(productName);
+        framePayload(pending);
+        ++pendingRecords;
+    }
+
+    // Private helper function to append the record in payload to a buffer, prefixed by its checksum and size
+    void framePayload(BinaryWriter &into) {
+        into.put(checksum32(payload.getBytes()));
+        into.put(static_cast<uint32_t>(payload.size()));
+        into.putBytes(payload.getBytes());
+    }
+
+    // Private helper function to call visit(record) for every intact framed record of a file's contents.
+    // Returns the offset just past the last intact record
+    template <typename Visitor>
+    static size_t forEachFramedRecord(string_view contents, Visitor visit) {
+        BinaryReader reader(contents);
+        size_t validEnd = 0;
+        while (reader.remaining() > 0) {
+            uint32_t storedChecksum = 0, size = 0;
+            if (!reader.get(storedChecksum) || !reader.get(size) || reader.remaining() < size) {
+                break; // Torn write at the end of the file
+            }
+            string_view record = contents.substr(reader.getOffset(), size);
+            if (checksum32(record) != storedChecksum) {
+                break;
+            }
+            reader.skip(size);
+            if (!visit(record)) {
+                break;
+            }
+            validEnd = reader.getOffset();
+        }
+        return validEnd;
+    }
+
+    // Private helper function to split framed records into runs of about `chunkBytes` whole frames each,
+    // reading only the frame sizes. Returns the offset where every run starts, followed by the end of the
+    // last complete frame. Checksums are left to whoever reads the runs
+    static vector<size_t> splitFramedRecords(string_view contents, size_t chunkBytes);
+
+    // Private helper function to decode the payload of one history archive record
+    static bool decodeArchivedEvent(string_view record, string_view &name, HistoryEvent &event) {
+        BinaryReader fields(record);
+        int64_t quantity = 0;
+        event = {};
+        if (!fields.get(event.type) || !fields.get(event.timestamp) || !fields.get(quantity) ||
+            !fields.getString(name)) {
+            return false;
+        }
+        event.quantity = Quantity::fromMilliUnits(quantity);
+        return true;
+    }
+
+    // Private helper function to encode the header a log file starts with
+    static string logHeader(const char (&magic)[8]) {
+        BinaryWriter header;
+        header.putBytes(string_view(magic, sizeof(magic)));
+        header.put(LOG_VERSION);
+        return header.getBytes();
+    }
+
+    // Private helper function to check the header of a log file's contents and strip it. An empty file,
+    // or one torn while its header was being written, is a new log and reads as empty. Returns false if
+    // the file is of another kind or version
+    bool stripLogHeader(string_view &contents, const char (&magic)[8], const string &path) {
+        string header = logHeader(magic);
+        if (contents.size() < header.size() && header.starts_with(contents)) {
+            contents = string_view();
+            return true;
+        }
+        if (!contents.starts_with(header)) {
+            lastError = path + " is not a version " + to_string(LOG_VERSION) + " log";
+            return false;
+        }
+        contents.remove_prefix(header.size());
+        return true;
+    }
+
+    // Private helper function to give a log file opened for appending its header, unless it has one
+    bool startLog(int descriptor, const char (&magic)[8], const string &path);
+
+    bool loadSnapshot(uint64_t &snapshotSequence);
+    bool replayWal(uint64_t snapshotSequence);
+    bool writeSnapshot();
+
+public:
+    // Constructor to keep the files in a directory (created if missing)
+    explicit FridgeStorage(string dataDirectory, size_t recordsPerSnapshot = 100000)
+        : directory(move(dataDirectory)), snapshotInterval(recordsPerSnapshot) {}
+
+    FridgeStorage(const FridgeStorage &) = delete;
+    FridgeStorage &operator=(const FridgeStorage &) = delete;
+
+    ~FridgeStorage() {
+        close();
+    }
+
+    // Method to restore a refrigerator from the snapshot and WAL, then log its future changes.
+    // The refrigerator should be empty. Returns false (see getLastError) if the files cannot be used
+    bool open(Refrigerator &target);
+
+    // Method to write pending records and the WAL, then stop persisting the refrigerator
+    void close();
+
+    // Methods called by the refrigerator for every successful change
+    void appendInsert(string_view productName, Quantity quantity, const Date &expirationDate, uint32_t timestamp) {
+        appendRecord(WalRecordType::Insert, timestamp, quantity, expirationDate.getDays(), productName);
+    }
+
+    void appendConsume(string_view productName, Quantity quantity, uint32_t timestamp) {
+        appendRecord(WalRecordType::Consume, timestamp, quantity, 0, productName);
+    }
+
+    void appendPurge(const Date &currentDate, uint32_t timestamp) {
+        appendRecord(WalRecordType::Purge, timestamp, 0, currentDate.getDays(), string_view());
+    }
+
+    // Method called by the refrigerator for every history event its retention policy rolls up.
+    // The archive is only ever appended to, so it outlives the WAL truncation at each checkpoint
+    void appendArchivedEvent(string_view productName, const HistoryEvent &event) {
+        payload.clear();
+        payload.put(event.type);
+        payload.put(event.timestamp);
+        payload.put(event.quantity.getMilliUnits());
+        payload.putString(productName);
+        framePayload(pendingArchive);
+    }
+
+    // Method to call visit(name, event) for every event in the history archive, oldest first. The event's
+    // product id is not meaningful (ids are not stable between runs); use the name.
+    // Returns false (see getLastError) if the archive cannot be read
+    template <typename Visitor>
+    bool forEachArchivedEvent(Visitor visit) {
+        string file;
+        if (!readFile(archivePath(), file)) {
+            return fail("cannot read " + archivePath());
+        }
+        string_view contents = file;
+        if (!stripLogHeader(contents, ARCHIVE_MAGIC, archivePath())) {
+            return false;
+        }
+        forEachFramedRecord(contents, [&](string_view record) {
+            HistoryEvent event;
+            string_view name;
+            if (!decodeArchivedEvent(record, name, event)) {
+                return false;
+            }
+            visit(name, event);
+            return true;
+        });
+        return true;
+    }
+
+    // Method to total, per product name, the consumption in the history archive on a pool's threads.
+    // The mapped archive is cut into runs of whole records; each run is checked and summed into its own
+    // partial map, and the partials are merged in file order up to the first damaged record, so the
+    // totals are exactly those of a sequential pass with forEachArchivedEvent.
+    // Returns false (see getLastError) if the archive cannot be read
+    bool tallyArchivedConsumption(WorkStealingPool &pool, unordered_map<string, Quantity> &totals);
+
+    // Method to write and fsync every pending record in one go (taking a snapshot if one is due)
+    bool commit();
+
+    // Method to group the commits of a batch job: while enabled, commit() only writes once about a
+    // megabyte of records is pending, so a crash can lose the last few thousand changes of the batch.
+    // Disabling it commits whatever is still pending
+    bool setBatchCommits(bool enabled) {
+        batchCommits = enabled;
+        return enabled || commit();
+    }
+
+    // Method to write a snapshot of the current state now and empty the WAL
+    bool checkpoint();
+
+    // Getter method to retrieve the path of the snapshot file, e.g. to map it with MappedSnapshot
+    string getSnapshotPath() const {
+        return snapshotPath();
+    }
+
+    // Getter methods to retrieve storage statistics and the last error
+    size_t getReplayedRecords() const {
+        return replayedRecords;
+    }
+
+    size_t getWalRecords() const {
+        return walRecords + pendingRecords;
+    }
+
+    const string &getLastError() const {
+        return lastError;
+    }
+};
+
+// LatencyHistogram counts durations in log-linear buckets, like an HDR histogram: every power of two is
+// split into 2^SUB_BUCKET_BITS equal buckets, so any recorded value is known to within 1/16 of itself
+// while the whole range from 1 ns to about 36 minutes takes a fixed, small array
+class LatencyHistogram {
+public:
+    static constexpr uint32_t SUB_BUCKET_BITS = 4;
+    static constexpr uint32_t SUB_BUCKETS = 1u << SUB_BUCKET_BITS;
+    static constexpr uint32_t MAX_EXPONENT = 41; // Values of 2^(MAX_EXPONENT + 1) ns and more share the top bucket
+    static constexpr size_t BUCKET_COUNT = (MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS;
+
+private:
+    array<uint64_t, BUCKET_COUNT> counts{};
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t minimum = UINT64_MAX;
+    uint64_t maximum = 0;
+
+    // Private helper function to get the bucket of a value: exact below SUB_BUCKETS, then the
+    // SUB_BUCKET_BITS bits after the leading one select the bucket within its power of two
+    static size_t bucketOf(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return static_cast<size_t>(value);
+        }
+        value = min(value, (uint64_t(1) << (MAX_EXPONENT + 1)) - 1);
+        uint32_t shift = static_cast<uint32_t>(bit_width(value)) - 1 - SUB_BUCKET_BITS;
+        return (shift + 1) * SUB_BUCKETS + static_cast<size_t>((value >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    // Private helper function to get the largest value that falls into a bucket
+    static uint64_t bucketUpperBound(size_t bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return bucket;
+        }
+        uint32_t shift = static_cast<uint32_t>(bucket / SUB_BUCKETS) - 1;
+        uint64_t lower = (SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+        return lower + (uint64_t(1) << shift) - 1;
+    }
+
+public:
+    // Method to count one duration, in nanoseconds
+    void record(uint64_t nanoseconds) {
+        ++counts[bucketOf(nanoseconds)];
+        ++total;
+        sum += nanoseconds;
+        minimum = min(minimum, nanoseconds);
+        maximum = max(maximum, nanoseconds);
+    }
+
+    // Method to get the value below which a fraction `quantile` (0..1) of the durations fall
+    uint64_t percentile(double quantile) const {
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = max<uint64_t>(1, static_cast<uint64_t>(quantile * static_cast<double>(total) + 0.5));
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < BUCKET_COUNT; ++bucket) {
+            seen += counts[bucket];
+            if (seen >= rank) {
+                return min(bucketUpperBound(bucket), maximum);
+            }
+        }
+        return maximum;
+    }
+
+    // Getter methods to retrieve the summary values
+    uint64_t getCount() const {
+        return total;
+    }
+
+    uint64_t getMin() const {
+        return total == 0 ? 0 : minimum;
+    }
+
+    uint64_t getMax() const {
+        return maximum;
+    }
+
+    double getMean() const {
+        return total == 0 ? 0 : static_cast<double>(sum) / static_cast<double>(total);
+    }
+};
+
+// The public Refrigerator operations that are measured
+enum class MetricOperation : uint8_t {
+    Insert, // insertProduct, tryInsert
+    Consume, // consumeProduct, tryConsume
+    ExpirationCheck, // checkExpirations, purgeExpired
+    Report, // showStatus, showHistory, generateShoppingList
+    Batch, // insertBatch, consumeBatch (one sample per batch)
+    Count
+};
+
+// Display names of the operations, also used as keys of the JSON dump
+constexpr const char *METRIC_OPERATION_NAMES[] = {"insert", "consume", "expiration_check", "report", "batch"};
+
+// Counters and latencies of one kind of operation
+struct OperationMetrics {
+    uint64_t failures = 0; // Operations that returned an error status
+    LatencyHistogram latency; // Also counts the operations
+};
+
+// RefrigeratorMetrics records every measured operation of a refrigerator. Single-threaded, like the
+// refrigerator it belongs to
+class RefrigeratorMetrics {
+private:
+    array<OperationMetrics, static_cast<size_t>(MetricOperation::Count)> operations;
+
+public:
+    // Timer measures one operation from its creation to its destruction
+    class Timer {
+    private:
+        OperationMetrics &target;
+        chrono::steady_clock::time_point start;
+        bool failed = false;
+
+    public:
+        explicit Timer(OperationMetrics &metrics) : target(metrics), start(chrono::steady_clock::now()) {}
+
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+
+        ~Timer() {
+            auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+            target.latency.record(static_cast<uint64_t>(elapsed));
+            if (failed) {
+                ++target.failures;
+            }
+        }
+
+        // Method to count the operation as failed
+        void fail() {
+            failed = true;
+        }
+    };
+
+    Timer time(MetricOperation operation) {
+        return Timer(operations[static_cast<size_t>(operation)]);
+    }
+
+    const OperationMetrics &get(MetricOperation operation) const {
+        return operations[static_cast<size_t>(operation)];
+    }
+};
+
+// DisabledMetrics has the recording interface of RefrigeratorMetrics and does nothing, so when metrics
+// are compiled out the calls (and the clock reads) disappear
+class DisabledMetrics {
+public:
+    struct Timer {
+        ~Timer() {} // User-provided, so an unused timer is not warned about
+        void fail() {}
+    };
+
+    Timer time(MetricOperation) {
+        return {};
+    }
+};
+
+using MetricsRecorder = conditional_t<FRIDGE_ENABLE_METRICS != 0, RefrigeratorMetrics, DisabledMetrics>;
+
+// Function to write the printable description of a history event, e.g. "Inserted 2.000000 of milk"
+inline void describeAction(ReportWriter &report, const ProductCatalog &catalog, const HistoryEvent &event) {
+    report << (event.type == ActionType::Insert ? "Inserted " : "Consumed ");
+    report.fixed(event.quantity.toDouble()) << " of " << catalog.getName(event.productId);
+}
+
+// One product with lots expiring by the date of an ExpiringView
+struct ExpiringItem {
+    ProductId productId;
+    string_view name;
+    Quantity expiringQuantity; // Quantity in the lots expiring by the date
+    Quantity remainingQuantity; // Quantity in the later lots, which a purge would leave
+    Date earliestExpiration;
+};
+
+// One product of a top-K query (see Refrigerator::findLowestStock and findExpiringSoonest)
+struct StockItem {
+    ProductId productId;
+    string_view name;
+    Quantity quantity;
+    Date earliestExpiration;
+    uint32_t lotCount;
+};
+
+// Aspects of a product a change subscription can watch, as a bitmask (see Refrigerator::subscribe)
+constexpr uint8_t CHANGE_QUANTITY = 1; // Total quantity
+constexpr uint8_t CHANGE_EXPIRATION = 2; // Earliest lot expiration
+constexpr uint8_t CHANGE_REMOVAL = 4; // The product left the refrigerator (used up or expired entirely)
+constexpr uint8_t CHANGE_ALL = CHANGE_QUANTITY | CHANGE_EXPIRATION | CHANGE_REMOVAL;
+
+// Net change of one product since a subscription's previous delivery. `changes` holds the watched aspects
+// that differ (a new product changed quantity and expiration; a removed one all three); the other fields
+// are the product's current state, zero once it is removed
+struct ProductChange {
+    ProductId productId;
+    string_view name;
+    uint8_t changes;
+    Quantity quantity;
+    Date earliestExpiration;
+    uint32_t lotCount;
+};
+
+// Handle of a change subscription
+using SubscriptionId = uint32_t;
+
+// ExpiringView is a read-only answer to "what expires by this date": the slots of the matching products,
+// found through the store's expiration order, described lazily. It stays valid until the refrigerator that
+// made it changes, and can then be handed back to Refrigerator::purgeExpired to remove exactly those lots
+// without looking them up again.
+template <typename Store>
+class BasicExpiringView {
+private:
+    const void *owner; // The refrigerator that made the view
+    uint64_t changeCount; // The owner's change count when the view was made
+    const Store *products;
+    const ProductCatalog *catalog;
+    vector<uint32_t> slots; // Slots of the products with lots expiring by date, ascending
+    Date date;
+
+    template <typename, typename, typename>
+    friend class BasicRefrigerator;
+
+    BasicExpiringView(const void *owner, uint64_t changeCount, const Store &products,
+                 const ProductCatalog &catalog, const Date &date)
+        : owner(owner), changeCount(changeCount), products(&products), catalog(&catalog), date(date) {
+        vector<uint64_t> mask;
+        products.findExpiring(date.getDays(), slots, mask);
+    }
+
+    // Private helper function to describe the product in one matching slot
+    ExpiringItem itemAt(uint32_t slot) const {
+        Quantity expiring;
+        for (const Lot &lot : products->getLots(slot)) {
+            if (lot.expirationDate > date) {
+                break; // Lots are sorted by expiration
+            }
+            expiring += lot.quantity;
+        }
+        ProductId productId = products->getId(slot);
+        return {productId, catalog->getName(productId), expiring, products->getQuantity(slot) - expiring,
+                products->getExpirationDate(slot)};
+    }
+
+public:
+    // Forward iterator over the expiring products, in storage order
+    class iterator {
+    private:
+        const BasicExpiringView *view;
+        size_t index; // Position in the view's slots
+
+    public:
+        using iterator_category = forward_iterator_tag;
+        using value_type = ExpiringItem;
+        using difference_type = ptrdiff_t;
+        using pointer = void;
+        using reference = ExpiringItem;
+
+        iterator(const BasicExpiringView *view, size_t index) : view(view), index(index) {}
+
+        ExpiringItem operator*() const {
+            return view->itemAt(view->slots[index]);
+        }
+
+        iterator &operator++() {
+            ++index;
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator previous = *this;
+            ++*this;
+            return previous;
+        }
+
+        bool operator==(const iterator &other) const {
+            return index == other.index;
+        }
+    };
+
+    iterator begin() const {
+        return iterator(this, 0);
+    }
+
+    iterator end() const {
+        return iterator(this, slots.size());
+    }
+
+    // Getter method to retrieve the number of expiring products
+    size_t size() const {
+        return slots.size();
+    }
+
+    bool empty() const {
+        return slots.empty();
+    }
+
+    // Getter method to retrieve the date the view was asked for
+    Date getDate() const {
+        return date;
+    }
+};
+
+using ExpiringView = BasicExpiringView<FlatProductStore>;
+
+// BasicRefrigerator manages multiple products, tracks actions performed, and handles refrigerator operations.
+// Its policies decide at compile time what it pays for (see FlatStore, FullHistory and NoLock for the
+// choices): BasicRefrigerator<CompactStore, NoHistory, NoLock> is only the dense product columns and
+// their lookup table, with no logging, aggregates or locking left in the update path. Operations that
+// need a feature the configuration leaves out are not available on it. The quantity type is not a policy:
+// every configuration uses Quantity, because the store columns, lots, history events, snapshot, WAL and
+// server protocol all share its exact milli-unit encoding, and a second representation would fork each
+// of those formats for no saving (Quantity is already an 8-byte integer)
+template <typename StorePolicy, typename HistoryPolicy, typename LockPolicy>
+class BasicRefrigerator {
+private:
+    using Store = typename StorePolicy::Store;
+    using Mutex = typename LockPolicy::Mutex;
+    using View = BasicExpiringView<Store>;
+    static constexpr bool HISTORY = HistoryPolicy::ENABLED;
+
+    // Stand-in for a member of a feature that is compiled out: empty, and constructible from anything
+    template <typename T>
+    struct Omitted {
+        template <typename... Arguments>
+        Omitted(Arguments &&...) {}
+    };
+
+    template <typename T>
+    using HistoryMember = conditional_t<HISTORY, T, Omitted<T>>;
+
+    pmr::memory_resource *memory; // Where the containers below allocate (the default heap unless a pool is given)
+    shared_ptr<ProductCatalog> catalog; // Interned product names, possibly shared with other refrigerators
+    Store products; // Dense storage of the products, addressed by slot and looked up by catalog id
+    // The most recent actions (insertions, consumptions), or all of them unless a retention is set
+    [[no_unique_address]] HistoryMember<HistoryLog> history;
+    [[no_unique_address]] HistoryMember<HistoryRetention> retention; // How much history is kept (see setHistoryRetention)
+    // Rolled-up history, keyed by day << 32 | product id
+    [[no_unique_address]] HistoryMember<pmr::map<uint64_t, HistoryDaySummary>> historySummaries;
+    vector<uint32_t> expiredSlots; // Scratch list of the slots found expired, reused between checks
+    vector<uint64_t> expiredMask; // Scratch bitmask for the dense sweep (see findExpiring)
+    ReportWriter report; // Buffers everything the refrigerator prints
+    FridgeStorage *storage = nullptr; // Durable log of the changes, if one is attached (see FridgeStorage::open)
+    // Whether actions are appended to history (see setHistoryRecording)
+    [[no_unique_address]] HistoryMember<bool> recordHistory = true;
+    // Optional callback receiving every logged action
+    [[no_unique_address]] HistoryMember<function<void(const HistoryEvent &)>> actionListener;
+    // Running total consumed per product id, kept up to date by consumeProduct
+    [[no_unique_address]] HistoryMember<QuantityMap> consumedTotals;
+    // Smoothed daily consumption per product id
+    [[no_unique_address]] HistoryMember<pmr::unordered_map<ProductId, ConsumptionRate>> consumptionRates;
+    [[no_unique_address]] HistoryMember<ForecastPolicy> forecast;
+    // Weight of a new day in consumptionRates, derived from forecast.halfLifeDays
+    [[no_unique_address]] HistoryMember<double> rateAlpha = 0;
+    uint64_t changeCount = 0; // Bumped by every change to the products, so an ExpiringView can tell it is stale
+    [[no_unique_address]] MetricsRecorder metrics; // Operation counters and latencies (empty when compiled out)
+    [[no_unique_address]] mutable Mutex lock; // Taken by every public operation (a no-op with NoLock)
+
+    static constexpr uint32_t SECONDS_PER_DAY = 86400;
+    static constexpr size_t CONSUMPTION_WINDOW_DAYS = 28; // Longest window supported by the time-windowed shopping list
+    static constexpr size_t TALLY_BLOCK_EVENTS = 1 << 16; // History events summed by one task of a parallel tally
+    // Ring of CONSUMPTION_WINDOW_DAYS daily buckets, indexed by day modulo its size
+    [[no_unique_address]] HistoryMember<vector<ConsumptionBucket>> consumptionBuckets;
+
+    // What a product looked like before its first change since a subscription's last delivery
+    struct ProductState {
+        Quantity quantity;
+        uint32_t expirationDays = 0;
+        bool present = false;
+    };
+
+    struct Subscription {
+        SubscriptionId id;
+        uint8_t watched; // CHANGE_* bits
+        chrono::steady_clock::duration interval;
+        chrono::steady_clock::time_point nextDelivery;
+        function<void(span<const ProductChange>)> deliver;
+        unordered_map<ProductId, ProductState> baseline; // Products changed since the last delivery
+    };
+
+    [[no_unique_address]] HistoryMember<vector<Subscription>> subscriptions; // See subscribe
+    [[no_unique_address]] HistoryMember<SubscriptionId> lastSubscriptionId = 0;
+    [[no_unique_address]] HistoryMember<vector<ProductChange>> changeBatch; // Scratch buffer of deliverSubscription
+
+    friend class FridgeStorage; // Restores the state from, and writes it to, the snapshot
+    friend class Fleet; // Reads the product columns directly for its parallel queries
+    friend class IngestionPipeline; // Applies queued events in batches, with one storage commit per batch
+
+    // Private helper function to get the current time as stored in history events
+    static uint32_t currentTimestamp() {
+        return static_cast<uint32_t>(time(nullptr));
+    }
+
+    // Private helper functions to take the lock for an update (reports count as updates, since they
+    // write to the report buffer) or for a read
+    lock_guard<Mutex> lockForUpdate() const {
+        return lock_guard<Mutex>(lock);
+    }
+
+    shared_lock<Mutex> lockForRead() const {
+        return shared_lock<Mutex>(lock);
+    }
+
+    // Private helper function to log actions performed on the refrigerator
+    HistoryEvent logAction(ActionType type, ProductId productId, Quantity quantity, uint32_t timestamp) {
+        HistoryEvent event = {quantity, productId, timestamp, type};
+        if constexpr (HISTORY) {
+            HistoryEvent evicted;
+            if (recordHistory && history.push(event, evicted)) {
+                rollUpEvent(evicted);
+                trimSummaries(evicted.timestamp / SECONDS_PER_DAY);
+            }
+            if (actionListener) {
+                actionListener(event);
+            }
+        }
+        return event;
+    }
+
+    // Private helper function called just before a product changes: each subscription that has not seen the
+    // product change since its last delivery remembers its state, so the delivery can report the net change
+    void noteChange(ProductId productId, uint32_t slot) {
+        if constexpr (HISTORY) {
+            if (subscriptions.empty()) {
+                return;
+            }
+            ProductState before;
+            if (slot != Store::NOT_FOUND) {
+                before = {products.getQuantity(slot), products.getExpirationDate(slot).getDays(), true};
+            }
+            for (Subscription &subscription : subscriptions) {
+                subscription.baseline.try_emplace(productId, before);
+            }
+        }
+    }
+
+    // Private helper function to hand a subscription the net change of every product changed since its
+    // last delivery (nothing if none of them changed in a watched way)
+    void deliverSubscription(Subscription &subscription) {
+        changeBatch.clear();
+        for (const auto &[productId, before] : subscription.baseline) {
+            ProductChange change = {productId, catalog->getName(productId), 0, Quantity(), Date(), 0};
+            uint32_t slot = products.find(productId);
+            if (slot != Store::NOT_FOUND) {
+                change.quantity = products.getQuantity(slot);
+                change.earliestExpiration = products.getExpirationDate(slot);
+                change.lotCount = static_cast<uint32_t>(products.getLots(slot).size());
+                if (!before.present || change.quantity != before.quantity) {
+                    change.changes |= CHANGE_QUANTITY;
+                }
+                if (!before.present || change.earliestExpiration.getDays() != before.expirationDays) {
+                    change.changes |= CHANGE_EXPIRATION;
+                }
+            } else if (before.present) {
+                change.changes = CHANGE_ALL;
+            }
+            change.changes &= subscription.watched;
+            if (change.changes != 0) {
+                changeBatch.push_back(change);
+            }
+        }
+        subscription.baseline.clear();
+        if (!changeBatch.empty()) {
+            subscription.deliver(changeBatch);
+        }
+    }
+
+    // Private helper function to add an event dropped from the raw history to its daily summary
+    void rollUpEvent(const HistoryEvent &event) {
+        uint32_t day = event.timestamp / SECONDS_PER_DAY;
+        HistoryDaySummary &summary = historySummaries[uint64_t(day) << 32 | event.productId];
+        summary.day = day;
+        summary.productId = event.productId;
+        if (event.type == ActionType::Insert) {
+            summary.inserted += event.quantity;
+            ++summary.insertCount;
+        } else {
+            summary.consumed += event.quantity;
+            ++summary.consumeCount;
+        }
+        if (retention.spillToStorage && storage != nullptr) {
+            storage->appendArchivedEvent(catalog->getName(event.productId), event);
+        }
+    }
+
+    // Private helper function to drop the daily summaries that fell out of the retention window
+    void trimSummaries(uint32_t newestDay) {
+        if (retention.summaryDays == 0 || newestDay < retention.summaryDays) {
+            return;
+        }
+        uint64_t firstKept = uint64_t(newestDay - retention.summaryDays + 1) << 32;
+        historySummaries.erase(historySummaries.begin(), historySummaries.lower_bound(firstKept));
+    }
+
+    // Private helper function to make the changes of a public operation durable in one group commit
+    void commitStorage() {
+        if (storage != nullptr && !storage->commit()) {
+            report << "Error: " << storage->getLastError() << '\n';
+            report.endReport();
+        }
+    }
+
+    // Private helper function to fold a consumption into the smoothed rate of its product in O(1)
+    void recordRate(ProductId productId, uint32_t day, Quantity consumed) {
+        double quantity = consumed.toDouble();
+        auto [it, added] = consumptionRates.try_emplace(productId);
+        ConsumptionRate &rate = it->second;
+        if (added) {
+            rate.firstDay = rate.lastDay = day;
+        }
+        double retain = 1 - rateAlpha;
+        if (day >= rate.lastDay) {
+            if (day != rate.lastDay) {
+                rate.decayedSum *= pow(retain, day - rate.lastDay);
+                rate.lastDay = day;
+            }
+            rate.decayedSum += rateAlpha * quantity;
+        } else {
+            rate.decayedSum += rateAlpha * quantity * pow(retain, rate.lastDay - day); // Arrived out of order
+            rate.firstDay = min(rate.firstDay, day);
+        }
+    }
+
+    // Private helper function to get the smoothed daily consumption of a product as of a day
+    double dailyRate(const ConsumptionRate &rate, uint32_t today) const {
+        double retain = 1 - rateAlpha;
+        double elapsed = today > rate.lastDay ? today - rate.lastDay : 0;
+        double daysSeen = (today > rate.firstDay ? today - rate.firstDay : 0) + 1;
+        // Divide by the total weight of the days seen, so a product first consumed recently is not
+        // taken for one consumed at that rate forever
+        return rate.decayedSum * pow(retain, elapsed) / (1 - pow(retain, daysSeen));
+    }
+
+    // Private helper function to rebuild the smoothed rates from the daily buckets (after loading a
+    // snapshot, or when the half-life changes); consumption older than the window is lost
+    void rebuildConsumptionRates() {
+        consumptionRates.clear();
+        vector<const ConsumptionBucket *> days;
+        for (const ConsumptionBucket &bucket : consumptionBuckets) {
+            if (!bucket.consumed.empty()) {
+                days.push_back(&bucket);
+            }
+        }
+        sort(days.begin(), days.end(), [](const ConsumptionBucket *a, const ConsumptionBucket *b) {
+            return a->day < b->day;
+        });
+        for (const ConsumptionBucket *bucket : days) {
+            for (const auto &item : bucket->consumed) {
+                recordRate(item.first, bucket->day, item.second);
+            }
+        }
+    }
+
+    // Private helper function to add a consumption event to the running totals and to its daily bucket
+    void recordConsumption(const HistoryEvent &event) {
+        if constexpr (HISTORY) {
+            consumedTotals[event.productId] += event.quantity;
+
+            uint32_t day = event.timestamp / SECONDS_PER_DAY;
+            recordRate(event.productId, day, event.quantity);
+            ConsumptionBucket &bucket = consumptionBuckets[day % CONSUMPTION_WINDOW_DAYS];
+            if (bucket.day != day) {
+                // The slot still holds a day that has fallen out of the window, so recycle it
+                bucket.consumed.clear();
+                bucket.day = day;
+            }
+            bucket.consumed[event.productId] += event.quantity;
+        }
+    }
+
+    // Private helper function to total the consumption of the last `days` days (at most CONSUMPTION_WINDOW_DAYS)
+    QuantityMap consumedWithin(uint32_t days) const {
+        uint32_t today = Date::today().getDays();
+        QuantityMap consumptionMap;
+        for (const ConsumptionBucket &bucket : consumptionBuckets) {
+            // Skip empty slots and days outside the requested window
+            if (bucket.consumed.empty() || today - bucket.day >= days) {
+                continue;
+            }
+            for (const auto &item : bucket.consumed) {
+                consumptionMap[item.first] += item.second;
+            }
+        }
+        return consumptionMap;
+    }
+
+    // Private helper function to total the consumption the history holds per product, with the raw events
+    // split into blocks spread over a pool. Every pool slot sums into its own array indexed by product id,
+    // so no two threads write the same memory, and the arrays are added up at the end. Quantities add
+    // exactly, so the result does not depend on how the blocks were shared out
+    QuantityMap tallyHistory(WorkStealingPool &pool) const {
+        span<const HistoryEvent> events = history.getEvents();
+        size_t productCount = catalog->size(); // Every id in the history was interned before it was recorded
+        vector<vector<Quantity>> partials(pool.getWorkerCount() + 1);
+        size_t blockCount = (events.size() + TALLY_BLOCK_EVENTS - 1) / TALLY_BLOCK_EVENTS;
+        pool.parallelFor(blockCount, [&](size_t block, size_t slot) {
+            vector<Quantity> &partial = partials[slot];
+            if (partial.empty()) {
+                partial.resize(productCount); // Only slots that get work pay for an array
+            }
+            size_t end = min(events.size(), (block + 1) * TALLY_BLOCK_EVENTS);
+            for (size_t i = block * TALLY_BLOCK_EVENTS; i < end; ++i) {
+                if (events[i].type == ActionType::Consume) {
+                    partial[events[i].productId] += events[i].quantity;
+                }
+            }
+        });
+
+        QuantityMap totals;
+        for (const vector<Quantity> &partial : partials) {
+            for (ProductId productId = 0; productId < partial.size(); ++productId) {
+                if (partial[productId] != Quantity()) {
+                    totals[productId] += partial[productId];
+                }
+            }
+        }
+        for (const auto &item : historySummaries) {
+            if (item.second.consumeCount != 0) {
+                totals[item.second.productId] += item.second.consumed;
+            }
+        }
+        return totals;
+    }
+
+    // Private helper function to print a shopping list from per-product consumed quantities
+    void printShoppingList(string_view title, const QuantityMap &consumptionMap) {
+        report << "\n--- " << title << " ---\n";
+        if (consumptionMap.empty()) {
+            report << "No items to suggest for shopping.\n";
+        }
+
+        // Display the shopping list with suggested quantities to buy
+        for (const auto &item : consumptionMap) {
+            report << "- Buy more " << catalog->getName(item.first) << " (" << item.second << ")\n";
+        }
+        report.endReport();
+    }
+
+    // Private helper function that performs an insertion without printing anything, using a single store lookup
+    OperationStatus applyInsert(string_view productName, Quantity productQuantity, const Date &productExpirationDate,
+                                uint32_t timestamp = currentTimestamp()) {
+        // Validation: Ensure the quantity is representable and greater than zero before inserting
+        if (!productQuantity.isValid()) {
+            return OperationStatus::InvalidQuantity;
+        }
+        if (productQuantity <= 0) {
+            return OperationStatus::NonPositiveQuantity;
+        }
+
+        ProductId productId = catalog->intern(productName);
+        uint32_t slot = products.find(productId);
+        if (slot != Store::NOT_FOUND && products.getQuantity(slot).sumOverflows(productQuantity)) {
+            return OperationStatus::QuantityOverflow; // Refused rather than wrapped around
+        }
+        noteChange(productId, slot);
+        if (slot == Store::NOT_FOUND) {
+            // A new product, created with this delivery as its only lot
+            products.insert(productId, productQuantity, productExpirationDate);
+        } else {
+            // The product already exists, so add the delivery as a new lot with its own expiration date
+            products.addLot(slot, productQuantity, productExpirationDate);
+        }
+        ++changeCount;
+
+        // Log the action of inserting a product
+        logAction(ActionType::Insert, productId, productQuantity, timestamp);
+        if (storage != nullptr) {
+            storage->appendInsert(productName, productQuantity, productExpirationDate, timestamp);
+        }
+        return OperationStatus::Ok;
+    }
+
+    // Private helper function that performs a consumption without printing anything, using a single store lookup
+    OperationStatus applyConsume(string_view productName, Quantity productQuantity, uint32_t timestamp = currentTimestamp()) {
+        // Validation: Ensure the consumed quantity is representable and greater than zero
+        if (!productQuantity.isValid()) {
+            return OperationStatus::InvalidQuantity;
+        }
+        if (productQuantity <= 0) {
+            return OperationStatus::NonPositiveQuantity;
+        }
+
+        // Check if the product exists in the refrigerator (unknown names are not added to the catalog)
+        ProductId productId;
+        if (!catalog->find(productName, productId)) {
+            return OperationStatus::ProductNotFound;
+        }
+        uint32_t slot = products.find(productId);
+        if (slot == Store::NOT_FOUND) {
+            return OperationStatus::ProductNotFound;
+        }
+
+        // Ensure there's enough quantity of the product to consume
+        if (products.getQuantity(slot) < productQuantity) {
+            return OperationStatus::NotEnoughQuantity;
+        }
+
+        // Consume the specified quantity (earliest-expiring lots first) and update the product
+        noteChange(productId, slot);
+        products.consume(slot, productQuantity);
+        ++changeCount;
+
+        // Log the action of consuming a product
+        HistoryEvent event = logAction(ActionType::Consume, productId, productQuantity, timestamp);
+        recordConsumption(event); // Keep the shopping list aggregates current
+        if (storage != nullptr) {
+            storage->appendConsume(productName, productQuantity, timestamp);
+        }
+
+        // If the product quantity reaches zero, remove it from the refrigerator
+        if (products.getQuantity(slot) == 0) {
+            products.erase(slot);
+        }
+        return OperationStatus::Ok;
+    }
+
+    // Private helper function that removes every expired lot, optionally reporting each product
+    PurgeCounts removeExpired(const Date &currentDate, bool reportProducts) {
+        // The store's expiration order goes straight to the expired slots, without touching the others
+        products.findExpiring(currentDate.getDays(), expiredSlots, expiredMask);
+        return removeMarked(expiredSlots, currentDate, reportProducts);
+    }
+
+    // Private helper function that removes the lots expired by currentDate from the given slots (ascending)
+    PurgeCounts removeMarked(const vector<uint32_t> &slots, const Date &currentDate, bool reportProducts) {
+        PurgeCounts counts;
+
+        // Visit the slots from the highest down: erasing a slot moves the last slot into it,
+        // and every slot above the current one has already been handled
+        for (size_t index = slots.size(); index-- > 0;) {
+            uint32_t slot = slots[index];
+            const string &productName = catalog->getName(products.getId(slot));
+
+            // Only the expired lots are removed; later deliveries of the same product stay
+            noteChange(products.getId(slot), slot);
+            Quantity expiredQuantity = products.removeExpiredLots(slot, currentDate);
+            bool fullyExpired = products.getQuantity(slot) == 0;
+            if (fullyExpired) {
+                products.erase(slot); // Remove expired product from the refrigerator
+                ++counts.removedProducts;
+            }
+            ++counts.products;
+            counts.quantity += expiredQuantity;
+            if (!reportProducts) {
+                continue;
+            }
+            if (fullyExpired) {
+                report << "Product " << productName << " has expired. Please remove it.\n";
+            } else {
+                report << "Product " << productName << ": " << expiredQuantity
+                       << " has expired. Please remove it.\n";
+            }
+        }
+
+        if (counts.products != 0) {
+            ++changeCount;
+            if (storage != nullptr) {
+                storage->appendPurge(currentDate, currentTimestamp());
+            }
+        }
+        return counts;
+    }
+
+    // Private helper function to describe the product in a slot for a top-K query
+    StockItem makeStockItem(uint32_t slot) const {
+        return {products.getId(slot), catalog->getName(products.getId(slot)), products.getQuantity(slot),
+                products.getExpirationDate(slot), static_cast<uint32_t>(products.getLots(slot).size())};
+    }
+
+    // Private helper function to print the products of a top-K query
+    void printStockItems(const string &title, const vector<StockItem> &items) {
+        report << "\n--- " << title << " ---\n";
+        if (products.empty()) {
+            report << "The refrigerator is empty.\n";
+        }
+        for (const StockItem &item : items) {
+            report << "- " << item.name << ": " << item.quantity << " (Expires: " << item.earliestExpiration;
+            if (item.lotCount > 1) {
+                report << ", " << item.lotCount << " lots";
+            }
+            report << ")\n";
+        }
+        report.endReport();
+    }
+
+    // Private helper function to make room for a batch in one step instead of growing per row
+    void reserveForBatch(size_t rows) {
+        products.reserve(products.size() + rows);
+        if constexpr (HISTORY) {
+            history.reserve(rows);
+        }
+    }
+
+    // Private helper functions behind the top-K queries
+    vector<StockItem> collectLowestStock(size_t count) const {
+        vector<StockItem> items;
+        items.reserve(min(count, products.size()));
+        products.forEachLowestQuantity(count, [&](uint32_t slot) { items.push_back(makeStockItem(slot)); });
+        return items;
+    }
+
+    vector<StockItem> collectExpiringSoonest(size_t count) const {
+        vector<StockItem> items;
+        items.reserve(min(count, products.size()));
+        products.forEachEarliestExpiration(count, [&](uint32_t slot) { items.push_back(makeStockItem(slot)); });
+        return items;
+    }
+
+    // Private helper function behind forecastReorders
+    vector<ReorderSuggestion> computeReorders(const Date &today) const {
+        double horizon = static_cast<double>(forecast.leadTimeDays) + forecast.coverDays;
+        double reorderPoint = static_cast<double>(forecast.leadTimeDays) + forecast.safetyDays;
+        vector<ReorderSuggestion> suggestions;
+        for (const auto &[productId, rate] : consumptionRates) {
+            double perDay = dailyRate(rate, today.getDays());
+            if (!(perDay * horizon > 1e-9)) {
+                continue;
+            }
+
+            // Consume the lots in order at the daily rate; `covered` is how many days are served so far
+            double covered = 0;
+            double usable = 0;
+            uint32_t slot = products.find(productId);
+            if (slot != Store::NOT_FOUND) {
+                for (const Lot &lot : products.getLots(slot)) {
+                    if (covered >= horizon) {
+                        break;
+                    }
+                    double expiresIn = static_cast<double>(lot.expirationDate.getDays()) - today.getDays();
+                    double usableUntil = min(expiresIn, horizon);
+                    if (usableUntil <= covered) {
+                        continue; // Expires before its turn comes
+                    }
+                    double used = min(lot.quantity.toDouble(), perDay * (usableUntil - covered));
+                    usable += used;
+                    covered += used / perDay;
+                }
+            }
+            if (covered < reorderPoint) {
+                suggestions.push_back(
+                    {productId, catalog->getName(productId), perDay, usable, covered, perDay * horizon - usable});
+            }
+        }
+        sort(suggestions.begin(), suggestions.end(), [](const ReorderSuggestion &a, const ReorderSuggestion &b) {
+            return a.coverageDays < b.coverageDays || (a.coverageDays == b.coverageDays && a.productId < b.productId);
+        });
+        return suggestions;
+    }
+
+    // Private helper function to get the fill ratio of the product lookup table
+    double loadFactor() const {
+        size_t buckets = products.getBucketCount();
+        return buckets == 0 ? 0 : static_cast<double>(products.size()) / static_cast<double>(buckets);
+    }
+
+    // Private helper functions to get the size of the history, zero when it is compiled out
+    size_t historyEventCount() const {
+        if constexpr (HISTORY) {
+            return history.size();
+        }
+        return 0;
+    }
+
+    size_t historySummaryCount() const {
+        if constexpr (HISTORY) {
+            return historySummaries.size();
+        }
+        return 0;
+    }
+
+public:
+    // Default constructor to create an empty refrigerator with its own product catalog
+    BasicRefrigerator() : BasicRefrigerator(make_shared<ProductCatalog>()) {}
+
+    // Constructor to create an empty refrigerator that shares a product catalog with others and
+    // allocates from a memory resource, e.g. MemoryPool::getResource()
+    explicit BasicRefrigerator(shared_ptr<ProductCatalog> sharedCatalog,
+                               pmr::memory_resource *memoryResource = pmr::get_default_resource())
+        : memory(memoryResource), catalog(move(sharedCatalog)), products(memory), history(memory),
+          historySummaries(memory), consumedTotals(memory), consumptionRates(memory) {
+        if constexpr (HISTORY) {
+            setForecastPolicy(ForecastPolicy());
+            consumptionBuckets.reserve(CONSUMPTION_WINDOW_DAYS);
+            for (size_t i = 0; i < CONSUMPTION_WINDOW_DAYS; ++i) {
+                consumptionBuckets.emplace_back(memory);
+            }
+        }
+    }
+
+    // Getter method to retrieve the memory resource the refrigerator allocates from
+    pmr::memory_resource *getMemoryResource() const {
+        return memory;
+    }
+
+    // Getter method to retrieve the product catalog used to resolve names
+    const ProductCatalog &getCatalog() const {
+        return *catalog;
+    }
+
+    // Getter method to retrieve the writer used for all output, e.g. to change its stream or flush policy
+    ReportWriter &getReportWriter() {
+        return report;
+    }
+
+    // Method to turn the in-memory history log on or off. The listener (if any) still sees every action
+    void setHistoryRecording(bool enabled)
+        requires HISTORY
+    {
+        auto guard = lockForUpdate();
+        recordHistory = enabled;
+    }
+
+    // Method to bound the history: keep the last retention.rawEvents actions as they are and roll older
+    // ones into per-day, per-product summaries (optionally archiving them to the attached storage).
+    // The shopping lists never read the history, so they stay exact whatever is dropped here
+    void setHistoryRetention(const HistoryRetention &newRetention)
+        requires HISTORY
+    {
+        auto guard = lockForUpdate();
+        retention = newRetention;
+        uint32_t newestDay = 0;
+        history.setCapacity(retention.rawEvents, [&](const HistoryEvent &event) {
+            rollUpEvent(event);
+            newestDay = max(newestDay, event.timestamp / SECONDS_PER_DAY);
+        });
+        if (!historySummaries.empty()) {
+            trimSummaries(max(newestDay, historySummaries.rbegin()->second.day));
+        }
+        commitStorage();
+    }
+
+    // Getter method to retrieve the history retention in use
+    const HistoryRetention &getHistoryRetention() const
+        requires HISTORY
+    {
+        return retention;
+    }
+
+    // Method to call visit(summary) for every daily summary of rolled-up history, oldest day first
+    template <typename Visitor>
+    void forEachHistorySummary(Visitor visit) const
+        requires HISTORY
+    {
+        auto guard = lockForRead();
+        for (const auto &item : historySummaries) {
+            visit(item.second);
+        }
+    }
+
+    // Method to register a callback that receives every action as it is logged (or none, to remove it)
+    void setActionListener(function<void(const HistoryEvent &)> listener)
+        requires HISTORY
+    {
+        auto guard = lockForUpdate();
+        actionListener = move(listener);
+    }
+
+    // Method to subscribe to product changes. Every `interval` (see deliverChanges) `deliver` receives one
+    // ProductChange per product that changed since its previous delivery, however many times it changed,
+    // limited to the aspects in `watched` (CHANGE_* bits); an interval without such changes delivers
+    // nothing. Changes are noted as they are made, so no scan of the products is needed. `deliver` runs
+    // under the refrigerator's lock and must not call back into it
+    SubscriptionId subscribe(uint8_t watched, chrono::milliseconds interval,
+                             function<void(span<const ProductChange>)> deliver)
+        requires HISTORY
+    {
+        auto guard = lockForUpdate();
+        SubscriptionId id = ++lastSubscriptionId;
+        subscriptions.push_back({id, watched, interval, chrono::steady_clock::now() + interval, move(deliver), {}});
+        return id;
+    }
+
+    // Method to cancel a subscription; changes it has not been handed yet are dropped
+    void unsubscribe(SubscriptionId id)
+        requires HISTORY
+    {
+        auto guard = lockForUpdate();
+        erase_if(subscriptions, [&](const Subscription &subscription) { return subscription.id == id; });
+    }
+
+    // Method to deliver the pending changes of every subscription whose interval has elapsed. Returns when
+    // the next one is due (time_point::max() without subscriptions), for an event loop to sleep until then
+    chrono::steady_clock::time_point deliverChanges(chrono::steady_clock::time_point now = chrono::steady_clock::now())
+        requires HISTORY
+    {
+        auto guard = lockForUpdate();
+        auto next = chrono::steady_clock::time_point::max();
+        for (Subscription &subscription : subscriptions) {
+            if (subscription.nextDelivery <= now) {
+                deliverSubscription(subscription);
+                subscription.nextDelivery = now + subscription.interval;
+            }
+            next = min(next, subscription.nextDelivery);
+        }
+        return next;
+    }
+
+    // Method to insert a product like insertProduct does, returning the outcome instead of printing it
+    OperationStatus tryInsert(string_view productName, Quantity productQuantity, const Date &productExpirationDate) {
+        auto guard = lockForUpdate();
+        auto timer = metrics.time(MetricOperation::Insert);
+        OperationStatus status = applyInsert(productName, productQuantity, productExpirationDate);
+        if (status != OperationStatus::Ok) {
+            timer.fail();
+        }
+        commitStorage();
+        return status;
+    }
+
+    // Method to consume a product like consumeProduct does, returning the outcome instead of printing it
+    OperationStatus tryConsume(string_view productName, Quantity productQuantity) {
+        auto guard = lockForUpdate();
+        auto timer = metrics.time(MetricOperation::Consume);
+        OperationStatus status = applyConsume(productName, productQuantity);
+        if (status != OperationStatus::Ok) {
+            timer.fail();
+        }
+        commitStorage();
+        return status;
+    }
+
+    // Method to list the products with lots expiring on or before a date, without changing anything.
+    // With SharedLock only the lookup is done under the lock: visiting the view races with updates
+    View findExpiring(const Date &date) const {
+        auto guard = lockForRead();
+        return View(this, changeCount, products, *catalog, date);
+    }
+
+    // Method to list the products with lots expiring between now and `days` days from today
+    View findExpiringWithin(uint32_t days) const {
+        return findExpiring(Date(Date::today().getDays() + days));
+    }
+
+    // Method to list the `count` products closest to running out, lowest quantity first. The store keeps
+    // them ordered as it changes, so this costs O(count log count) whatever the number of products
+    vector<StockItem> findLowestStock(size_t count) const
+        requires Store::ORDERED
+    {
+        auto guard = lockForRead();
+        return collectLowestStock(count);
+    }
+
+    // Method to list the `count` products whose earliest lot expires soonest, soonest first
+    vector<StockItem> findExpiringSoonest(size_t count) const
+        requires Store::ORDERED
+    {
+        auto guard = lockForRead();
+        return collectExpiringSoonest(count);
+    }
+
+    // Method to remove every expired lot in one pass without printing anything
+    PurgeCounts purgeExpired(const Date &currentDate) {
+        auto guard = lockForUpdate();
+        auto timer = metrics.time(MetricOperation::ExpirationCheck);
+        PurgeCounts counts = removeExpired(currentDate, false);
+        commitStorage();
+        return counts;
+    }
+
+    // Method to remove the lots listed by a view, e.g. after showing it as a preview. The view's slots are
+    // reused if the refrigerator has not changed since it was made; otherwise the date is looked up again
+    PurgeCounts purgeExpired(const View &view) {
+        auto guard = lockForUpdate();
+        auto timer = metrics.time(MetricOperation::ExpirationCheck);
+        PurgeCounts counts = view.owner == this && view.changeCount == changeCount
+                                 ? removeMarked(view.slots, view.date, false)
+                                 : removeExpired(view.date, false);
+        commitStorage();
+        return counts;
+    }
+
+    // Method to call visit(name, quantity, earliest expiration, lots) for every product, in storage order
+    template <typename Visitor>
+    void forEachProduct(Visitor visit) const {
+        auto guard = lockForRead();
+        for (uint32_t slot = 0; slot < products.size(); ++slot) {
+            visit(catalog->getName(products.getId(slot)), products.getQuantity(slot), products.getExpirationDate(slot),
+                  products.getLots(slot));
+        }
+    }
+
+    // Method to call visit(name, consumed quantity) for every product ever consumed
+    template <typename Visitor>
+    void forEachConsumption(Visitor visit) const
+        requires HISTORY
+    {
+        auto guard = lockForRead();
+        for (const auto &item : consumedTotals) {
+            visit(catalog->getName(item.first), item.second);
+        }
+    }
+
+    // Method to call visit(name, consumed quantity) for every product consumed in the last `days` days
+    // (at most CONSUMPTION_WINDOW_DAYS), the data behind generateShoppingList(days)
+    template <typename Visitor>
+    void forEachConsumptionWithin(uint32_t days, Visitor visit) const
+        requires HISTORY
+    {
+        auto guard = lockForRead();
+        for (const auto &item : consumedWithin(min<uint32_t>(days, CONSUMPTION_WINDOW_DAYS))) {
+            visit(catalog->getName(item.first), item.second);
+        }
+    }
+
+    // Method to call visit(event) for every action in the history log, oldest first
+    template <typename Visitor>
+    void forEachAction(Visitor visit) const
+        requires HISTORY
+    {
+        auto guard = lockForRead();
+        history.forEach(visit);
+    }
+
+    // Method to insert a new product into the refrigerator or update the quantity of an existing product
+    void insertProduct(string_view productName, Quantity productQuantity, const Date &productExpirationDate) {
+        auto guard = lockForUpdate();
+        auto timer = metrics.time(MetricOperation::Insert);
+        switch (applyInsert(productName, productQuantity, productExpirationDate)) {
+        case OperationStatus::NonPositiveQuantity:
+            report << "Error: Product quantity must be greater than zero.\n";
+            break;
+        case OperationStatus::InvalidQuantity:
+            report << "Error: Invalid quantity.\n";
+            break;
+        case OperationStatus::QuantityOverflow:
+            report << "Error: The refrigerator cannot hold that much of the product.\n";
+            break;
+        default:
+            commitStorage();
+            return;
+        }
+        timer.fail();
+        report.endReport();
+    }
+
+    // Method to consume (reduce) the quantity of a specific product
+    void consumeProduct(string_view productName, Quantity productQuantity) {
+        auto guard = lockForUpdate();
+        auto timer = metrics.time(MetricOperation::Consume);
+        switch (applyConsume(productName, productQuantity)) {
+        case OperationStatus::NonPositiveQuantity:
+            report << "Error: Consumed quantity must be greater than zero.\n";
+            break;
+        case OperationStatus::ProductNotFound:
+            report << "Product not found in refrigerator.\n";
+            break;
+        case OperationStatus::NotEnoughQuantity:
+            report << "Not enough quantity to consume.\n";
+            break;
+        case OperationStatus::InvalidQuantity:
+        case OperationStatus::QuantityOverflow: // Only inserts can overflow
+            report << "Error: Invalid quantity.\n";
+            break;
+        case OperationStatus::Ok:
+            commitStorage();
+            return;
+        }
+        timer.fail();
+        report.endReport();
+    }
+
+    // Method to insert many products at once (e.g. a scanner export). Nothing is printed;
+    // the returned vector holds the outcome of each record, in the same order
+    vector<OperationStatus> insertBatch(span<const InsertRecord> records) {
+        auto guard = lockForUpdate();
+        auto timer = metrics.time(MetricOperation::Batch);
+        vector<OperationStatus> results;
+        results.reserve(records.size());
+        reserveForBatch(records.size());
+        for (const InsertRecord &record : records) {
+            results.push_back(applyInsert(record.productName, record.quantity, record.expirationDate));
+        }
+        commitStorage(); // One fsync for the whole batch
+        return results;
+    }
+
+    // Method to consume many products at once. Nothing is printed; the returned vector holds
+    // the outcome of each record, in the same order. Records are applied in order, so a later
+    // row sees the effect of earlier ones
+    vector<OperationStatus> consumeBatch(span<const ConsumeRecord> records) {
+        auto guard = lockForUpdate();
+        auto timer = metrics.time(MetricOperation::Batch);
+        vector<OperationStatus> results;
+        results.reserve(records.size());
+        if constexpr (HISTORY) {
+            history.reserve(records.size());
+        }
+        for (const ConsumeRecord &record : records) {
+            results.push_back(applyConsume(record.productName, record.quantity));
+        }
+        commitStorage(); // One fsync for the whole batch
+        return results;
+    }
+
+    // Method to look up a product by name. Returns false if it is not in the refrigerator
+    bool findProduct(string_view productName, Product &result) const {
+        auto guard = lockForRead();
+        ProductId productId;
+        if (!catalog->find(productName, productId)) {
+            return false;
+        }
+        uint32_t slot = products.find(productId);
+        if (slot == Store::NOT_FOUND) {
+            return false;
+        }
+        result = products.getProduct(slot);
+        return true;
+    }
+
+    // Method to display the current status of the refrigerator (list all products with quantities and expiration dates)
+    void showStatus() {
+        auto guard = lockForUpdate();
+        auto timer = metrics.time(MetricOperation::Report);
+        report << "\n--- Current Refrigerator Status ---\n";
+        if (products.empty()) {
+            report << "The refrigerator is empty.\n";
+        }
+
+        // Iterate through the product slots and display their information
+        for (uint32_t slot = 0; slot < products.size(); ++slot) {
+            report << "- " << catalog->getName(products.getId(slot)) << ": " << products.getQuantity(slot)
+                   << " (Expires: " << products.getExpirationDate(slot);
+            if (products.getLots(slot).size() > 1) {
+                report << ", " << static_cast<uint64_t>(products.getLots(slot).size()) << " lots";
+            }
+            report << ")\n";
+        }
+        report.endReport();
+    }
+
+    // Method to display the `count` products closest to running out
+    void showLowestStock(size_t count)
+        requires Store::ORDERED
+    {
+        auto guard = lockForUpdate();
+        auto timer = metrics.time(MetricOperation::Report);
+        printStockItems("Lowest Stock", collectLowestStock(count));
+    }
+
+    // Method to display the `count` products expiring soonest
+    void showExpiringSoonest(size_t count)
+        requires Store::ORDERED
+    {
+        auto guard = lockForUpdate();
+        auto timer = metrics.time(MetricOperation::Report);
+        printStockItems("Expiring Soonest", collectExpiringSoonest(count));
+    }
+
+    // Method to display the history of actions performed on the refrigerator
+    void showHistory()
+        requires HISTORY
+    {
+        auto guard = lockForUpdate();
+        auto timer = metrics.time(MetricOperation::Report);
+        report << "\n--- History of Actions ---\n";
+        if (history.empty() && historySummaries.empty()) {
+            report << "No actions recorded yet.\n";
+        }
+
+        // Older actions that were rolled up by the retention policy come first, one line per day and product
+        for (const auto &item : historySummaries) {
+            const HistoryDaySummary &summary = item.second;
+            report << "- " << Date(summary.day) << ": inserted ";
+            report.fixed(summary.inserted.toDouble()) << " and consumed ";
+            report.fixed(summary.consumed.toDouble()) << " of " << catalog->getName(summary.productId) << " ("
+                                           << summary.insertCount + summary.consumeCount << " actions)\n";
+        }
+
+        // Iterate through the history and print each action, formatting it only now
+        history.forEach([&](const HistoryEvent &event) {
+            report << "- ";
+            describeAction(report, *catalog, event);
+            report << '\n';
+        });
+        report.endReport();
+    }
+
+    // Method to check and remove expired lots based on the current date
+    void checkExpirations(const Date &currentDate) {
+        auto guard = lockForUpdate();
+        auto timer = metrics.time(MetricOperation::ExpirationCheck);
+        report << "\n--- Checking Expired Products ---\n";
+        if (removeExpired(currentDate, true).products == 0) {
+            report << "No expired products found.\n";
+        }
+        report.endReport();
+        commitStorage();
+    }
+
+    // Method to generate a shopping list based on all consumed products, using the running totals
+    void generateShoppingList()
+        requires HISTORY
+    {
+        auto guard = lockForUpdate();
+        auto timer = metrics.time(MetricOperation::Report);
+        printShoppingList("Generated Shopping List", consumedTotals);
+    }
+
+    // Method to generate a shopping list from products consumed during the last `days` days (today included)
+    void generateShoppingList(uint32_t days)
+        requires HISTORY
+    {
+        auto guard = lockForUpdate();
+        auto timer = metrics.time(MetricOperation::Report);
+        days = min<uint32_t>(days, CONSUMPTION_WINDOW_DAYS); // Older days are no longer kept in the ring
+        printShoppingList("Generated Shopping List (last " + to_string(days) + " days)", consumedWithin(days));
+    }
+
+    // Method to total, per product, the consumption recorded in the history (the raw events and the daily
+    // summaries still kept) on a pool's threads. With the full history kept it equals the running totals
+    // behind generateShoppingList(); it is the way to rebuild or check them from the log itself
+    QuantityMap tallyConsumption(WorkStealingPool &pool) const
+        requires HISTORY
+    {
+        auto guard = lockForRead();
+        return tallyHistory(pool);
+    }
+
+    // Method to generate a shopping list by recounting the history on a pool's threads rather than from
+    // the running totals (see tallyConsumption)
+    void generateShoppingList(WorkStealingPool &pool)
+        requires HISTORY
+    {
+        auto guard = lockForUpdate();
+        auto timer = metrics.time(MetricOperation::Report);
+        printShoppingList("Generated Shopping List (from the history)", tallyHistory(pool));
+    }
+
+    // Method to set the parameters of the forecasting shopping list. Changing the half-life rebuilds the
+    // rates from the last CONSUMPTION_WINDOW_DAYS days of consumption
+    void setForecastPolicy(const ForecastPolicy &policy)
+        requires HISTORY
+    {
+        auto guard = lockForUpdate();
+        bool rebuild = policy.halfLifeDays != forecast.halfLifeDays || rateAlpha == 0;
+        forecast = policy;
+        forecast.halfLifeDays = max(forecast.halfLifeDays, 0.1);
+        forecast.coverDays = max(forecast.coverDays, forecast.safetyDays);
+        if (rebuild) {
+            rateAlpha = 1 - pow(0.5, 1 / forecast.halfLifeDays);
+            rebuildConsumptionRates();
+        }
+    }
+
+    // Getter method to retrieve the parameters of the forecasting shopping list
+    const ForecastPolicy &getForecastPolicy() const
+        requires HISTORY
+    {
+        return forecast;
+    }
+
+    // Method to suggest what to reorder as of a day, most urgent first. For every product ever consumed,
+    // its smoothed daily rate is played against its lots (earliest expiring first, each usable only
+    // until it expires) over the lead time plus the cover period. A product whose usable stock runs out
+    // before the lead time plus the safety days is reordered up to the whole horizon. One pass over the
+    // rate table with a store lookup per product; the history is not read
+    vector<ReorderSuggestion> forecastReorders(const Date &today) const
+        requires HISTORY
+    {
+        auto guard = lockForRead();
+        return computeReorders(today);
+    }
+
+    // Method to print the forecast reorder suggestions as of a day
+    void generateForecastShoppingList(const Date &today)
+        requires HISTORY
+    {
+        auto guard = lockForUpdate();
+        auto timer = metrics.time(MetricOperation::Report);
+        report << "\n--- Forecast Shopping List ---\n";
+        vector<ReorderSuggestion> suggestions = computeReorders(today);
+        if (suggestions.empty()) {
+            report << "No items to suggest for shopping.\n";
+        }
+        for (const ReorderSuggestion &item : suggestions) {
+            report << "- Buy ";
+            report.fixed(item.orderQuantity, 2) << " " << item.name << " (uses ";
+            report.fixed(item.dailyRate, 2) << " a day, stock lasts ";
+            report.fixed(item.coverageDays, 1) << " days)\n";
+        }
+        report.endReport();
+    }
+
+    // Method to print the forecast reorder suggestions as of today
+    void generateForecastShoppingList()
+        requires HISTORY
+    {
+        generateForecastShoppingList(Date::today());
+    }
+
+    // Method to display the operation counts and latencies, the product table and the history size
+    void showMetrics() {
+        auto guard = lockForUpdate();
+        report << "\n--- Refrigerator Metrics ---\n";
+#if FRIDGE_ENABLE_METRICS
+        for (size_t i = 0; i < static_cast<size_t>(MetricOperation::Count); ++i) {
+            const OperationMetrics &operation = metrics.get(static_cast<MetricOperation>(i));
+            const LatencyHistogram &latency = operation.latency;
+            report << "- " << METRIC_OPERATION_NAMES[i] << ": " << latency.getCount() << " operations, "
+                   << operation.failures << " failed";
+            if (latency.getCount() != 0) {
+                report << "; latency p50 " << latency.percentile(0.5) << " ns, p99 " << latency.percentile(0.99)
+                       << " ns, max " << latency.getMax() << " ns";
+            }
+            report << '\n';
+        }
+#else
+        report << "Operation metrics are not compiled into this build (FRIDGE_ENABLE_METRICS).\n";
+#endif
+        report << "- products: " << static_cast<uint64_t>(products.size()) << " in "
+               << static_cast<uint64_t>(products.getBucketCount()) << " buckets (load factor ";
+        report.fixed(loadFactor(), 3) << "), " << static_cast<uint64_t>(products.getRehashCount())
+                                         << " rehashes\n";
+        report << "- history: " << static_cast<uint64_t>(historyEventCount()) << " events, "
+               << static_cast<uint64_t>(historySummaryCount()) << " daily summaries\n";
+        report.endReport();
+    }
+
+    // Method to write the same figures as showMetrics as one line of JSON, for monitoring scripts
+    void writeMetricsJson(ReportWriter &out) const {
+        auto guard = lockForRead();
+        out << "{\"operations\":{";
+#if FRIDGE_ENABLE_METRICS
+        for (size_t i = 0; i < static_cast<size_t>(MetricOperation::Count); ++i) {
+            const OperationMetrics &operation = metrics.get(static_cast<MetricOperation>(i));
+            const LatencyHistogram &latency = operation.latency;
+            out << (i == 0 ? "\"" : ",\"") << METRIC_OPERATION_NAMES[i] << "\":{\"count\":" << latency.getCount()
+                << ",\"failures\":" << operation.failures << ",\"latency_ns\":{\"min\":" << latency.getMin()
+                << ",\"mean\":" << latency.getMean() << ",\"p50\":" << latency.percentile(0.5)
+                << ",\"p90\":" << latency.percentile(0.9) << ",\"p99\":" << latency.percentile(0.99)
+                << ",\"p999\":" << latency.percentile(0.999) << ",\"max\":" << latency.getMax() << "}}";
+        }
+#endif
+        out << "},\"store\":{\"products\":" << static_cast<uint64_t>(products.size())
+            << ",\"buckets\":" << static_cast<uint64_t>(products.getBucketCount()) << ",\"load_factor\":" << loadFactor()
+            << ",\"rehashes\":" << static_cast<uint64_t>(products.getRehashCount())
+            << "},\"history\":{\"events\":" << static_cast<uint64_t>(historyEventCount())
+            << ",\"summaries\":" << static_cast<uint64_t>(historySummaryCount()) << "}}\n";
+    }
+
+    // Getter method to retrieve the fill ratio of the product lookup table
+    double getLoadFactor() const {
+        auto guard = lockForRead();
+        return loadFactor();
+    }
+
+    // Getter method to retrieve the recorded metrics (only when compiled in)
+    const MetricsRecorder &getMetrics() const {
+        return metrics;
+    }
+};
+
+// Ready-made configurations: the smallest refrigerator (no top-K orderings, no history), and a
+// full-featured one that any number of threads may call
+using CompactRefrigerator = BasicRefrigerator<CompactStore, NoHistory, NoLock>;
+using SharedRefrigerator = BasicRefrigerator<FlatStore, FullHistory, SharedLock>;
+
+// MpscRing is a bounded lock-free queue for many producer threads and one consumer (the classic
+// sequence-numbered ring: each cell records which lap it is ready for, so producers claim a position
+// with one compare-and-swap and never wait on each other). Pushing to a full ring fails instead of blocking.
+template <typename T>
+class MpscRing {
+private:
+    struct Cell {
+        atomic<size_t> sequence; // Position this cell is ready to be written (== position) or read (== position + 1) at
+        T value;
+    };
+
+    unique_ptr<Cell[]> cells;
+    size_t mask; // Capacity - 1 (capacity is a power of two)
+    alignas(64) atomic<size_t> tail{0}; // Next position producers claim
+    alignas(64) size_t head = 0; // Next position the consumer reads; only touched by the consumer
+
+public:
+    // Constructor to create a ring holding at least `capacity` values (rounded up to a power of two)
+    explicit MpscRing(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size *= 2;
+        }
+        cells = make_unique<Cell[]>(size);
+        mask = size - 1;
+        for (size_t i = 0; i < size; ++i) {
+            cells[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+
+    // Method to add a value from any thread. Returns false if the ring is full
+    bool tryPush(const T &value) {
+        size_t position = tail.load(memory_order_relaxed);
+        while (true) {
+            Cell &cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            intptr_t lag = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (lag == 0) {
+                if (tail.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.sequence.store(position + 1, memory_order_release); // Publish to the consumer
+                    return true;
+                }
+            } else if (lag < 0) {
+                return false; // The consumer has not freed this cell yet: the ring is full
+            } else {
+                position = tail.load(memory_order_relaxed); // Another producer took this position
+            }
+        }
+    }
+
+    // Getter method to retrieve how many positions producers have claimed so far. Every value pushed
+    // before the call is at a position below it
+    size_t getPushCount() const {
+        return tail.load(memory_order_acquire);
+    }
+
+    // Method to take the oldest value. Must only be called by one thread at a time. Returns false if empty
+    bool tryPop(T &value) {
+        Cell &cell = cells[head & mask];
+        size_t sequence = cell.sequence.load(memory_order_acquire);
+        if (static_cast<intptr_t>(sequence) - static_cast<intptr_t>(head + 1) < 0) {
+            return false;
+        }
+        value = cell.value;
+        cell.sequence.store(head + mask + 1, memory_order_release); // Hand the cell to the next lap of producers
+        ++head;
+        return true;
+    }
+};
+
+// ShardSnapshot is an immutable copy of the products and consumption of one shard of a
+// ConcurrentRefrigerator. Once published it is never modified, so any number of readers can scan it
+// without locks; it is freed when the last reader holding it lets go.
+struct ShardSnapshot {
+    struct ProductEntry {
+        const string *name; // Points into the catalog, which never moves an interned name
+        Quantity quantity;
+        Date expirationDate; // Earliest lot
+        uint32_t lotCount;
+    };
+
+    struct ConsumptionEntry {
+        const string *name;
+        Quantity quantity;
+    };
+
+    uint64_t version = 0; // The shard version this copy was taken at
+    vector<ProductEntry> products;
+    vector<ConsumptionEntry> consumed;
+};
+
+// RefrigeratorSnapshot is a consistent-per-shard, read-only view of a whole ConcurrentRefrigerator
+class RefrigeratorSnapshot {
+private:
+    vector<shared_ptr<const ShardSnapshot>> shards;
+
+public:
+    explicit RefrigeratorSnapshot(vector<shared_ptr<const ShardSnapshot>> shardSnapshots)
+        : shards(move(shardSnapshots)) {}
+
+    // Method to call visit(name, quantity, earliest expiration, lot count) for every product
+    template <typename Visitor>
+    void forEachProduct(Visitor visit) const {
+        for (const auto &shard : shards) {
+            for (const auto &entry : shard->products) {
+                visit(*entry.name, entry.quantity, entry.expirationDate, entry.lotCount);
+            }
+        }
+    }
+
+    // Method to call visit(name, consumed quantity) for every product ever consumed
+    template <typename Visitor>
+    void forEachConsumption(Visitor visit) const {
+        for (const auto &shard : shards) {
+            for (const auto &entry : shard->consumed) {
+                visit(*entry.name, entry.quantity);
+            }
+        }
+    }
+
+    // Getter method to retrieve the number of products in the snapshot
+    size_t getProductCount() const {
+        size_t count = 0;
+        for (const auto &shard : shards) {
+            count += shard->products.size();
+        }
+        return count;
+    }
+};
+
+// ConcurrentRefrigerator is a thread-safe refrigerator for deployments with many doors and scanners.
+// Products are sharded by the hash of their name over independent Refrigerators that share one catalog,
+// each behind its own reader-writer lock: updates to different shards never contend, and reports only
+// take shared locks, so they run alongside each other. Shards keep no history of their own; they forward
+// every action into one lock-free MpscRing, which is drained into the history log when history is read
+// (or when the ring fills up), so appending history never waits for an inventory lock.
+//
+// Reports read published snapshots instead of the shards (read-copy-update). Every successful update
+// bumps its shard's version; a reader that finds a shard's published copy out of date refreshes it
+// only if it can get the shard's shared lock without waiting, and otherwise keeps using the previous
+// copy. Readers therefore never block, and a writer is only ever held up by the copy of one shard,
+// never by a report being formatted. The shared_ptr reference counts act as the grace period: a
+// replaced copy lives until the last reader scanning it is done. Reports may lag the latest updates
+// while a shard is under constant write load.
+class ConcurrentRefrigerator {
+private:
+    struct Shard {
+        mutable shared_mutex lock; // Exclusive for updates, shared while taking a snapshot
+        MemoryPool pool; // Only used under the exclusive lock, so it needs no locking of its own
+        Refrigerator fridge;
+        atomic<uint64_t> version{0}; // Bumped by every update that changed the shard
+        atomic<shared_ptr<const ShardSnapshot>> published{make_shared<const ShardSnapshot>()};
+
+        explicit Shard(shared_ptr<ProductCatalog> catalog) : fridge(move(catalog), pool.getResource()) {}
+    };
+
+    shared_ptr<ProductCatalog> catalog; // Shared by all shards, so they agree on product ids
+    vector<unique_ptr<Shard>> shards;
+    size_t shardMask; // Shard count - 1 (the count is a power of two)
+    MpscRing<HistoryEvent> pendingHistory; // Actions not yet moved into history
+    mutable mutex historyLock; // Held by whoever drains pendingHistory (its single consumer) or reads history
+    vector<HistoryEvent> history; // Drained actions, in the order they were queued
+    mutex reportLock; // Serializes use of the report writer
+    ReportWriter report;
+
+    // Private helper function to pick the shard owning a product name
+    Shard &shardFor(string_view productName) {
+        return *shards[hash<string_view>{}(productName) & shardMask];
+    }
+
+    // Private helper function to get an up-to-date (or, if the shard is busy, the latest) snapshot of a shard
+    shared_ptr<const ShardSnapshot> snapshotShard(Shard &shard) {
+        shared_ptr<const ShardSnapshot> current = shard.published.load(memory_order_acquire);
+        if (current->version == shard.version.load(memory_order_acquire)) {
+            return current;
+        }
+
+        shared_lock<shared_mutex> reading(shard.lock, try_to_lock);
+        if (!reading.owns_lock()) {
+            return current; // A writer is busy with this shard; do not wait for it
+        }
+
+        auto fresh = make_shared<ShardSnapshot>();
+        fresh->version = shard.version.load(memory_order_relaxed); // Writers only bump it under the exclusive lock
+        fresh->products.reserve(current->products.size() + 1);
+        shard.fridge.forEachProduct([&](const string &name, Quantity quantity, const Date &expiration,
+                                        const LotList &lots) {
+            fresh->products.push_back({&name, quantity, expiration, static_cast<uint32_t>(lots.size())});
+        });
+        shard.fridge.forEachConsumption([&](const string &name, Quantity quantity) {
+            fresh->consumed.push_back({&name, quantity});
+        });
+        reading.unlock();
+
+        // Publish unless another reader got there first, in which case use its copy
+        shared_ptr<const ShardSnapshot> published = move(fresh);
+        if (!shard.published.compare_exchange_strong(current, published, memory_order_acq_rel)) {
+            return current;
+        }
+        return published;
+    }
+
+    // Private helper function to move queued actions into history; the caller holds historyLock
+    void drainHistoryLocked() {
+        HistoryEvent event;
+        while (pendingHistory.tryPop(event)) {
+            history.push_back(event);
+        }
+    }
+
+    // Private helper function run by the shards for every action they log
+    void enqueueAction(const HistoryEvent &event) {
+        while (!pendingHistory.tryPush(event)) {
+            // The ring is full: become the consumer for a moment and empty it
+            lock_guard<mutex> guard(historyLock);
+            drainHistoryLocked();
+        }
+    }
+
+public:
+    // Constructor to create a refrigerator with at least `shardCount` shards (rounded up to a power of two)
+    // and room for `queuedActions` history entries between drains
+    explicit ConcurrentRefrigerator(size_t shardCount = 16, size_t queuedActions = 65536,
+                                    shared_ptr<ProductCatalog> sharedCatalog = make_shared<ProductCatalog>())
+        : catalog(move(sharedCatalog)), pendingHistory(queuedActions) {
+        size_t count = 1;
+        while (count < shardCount) {
+            count *= 2;
+        }
+        shardMask = count - 1;
+        for (size_t i = 0; i < count; ++i) {
+            shards.push_back(make_unique<Shard>(catalog));
+            shards.back()->fridge.setHistoryRecording(false);
+            shards.back()->fridge.setActionListener([this](const HistoryEvent &event) { enqueueAction(event); });
+        }
+    }
+
+    ConcurrentRefrigerator(const ConcurrentRefrigerator &) = delete;
+    ConcurrentRefrigerator &operator=(const ConcurrentRefrigerator &) = delete;
+
+    // Getter method to retrieve the product catalog shared by the shards
+    const ProductCatalog &getCatalog() const {
+        return *catalog;
+    }
+
+    // Getter method to retrieve the writer used by the reports
+    ReportWriter &getReportWriter() {
+        return report;
+    }
+
+    // Method to insert a product from any thread. Only the product's shard is locked
+    OperationStatus insertProduct(string_view productName, Quantity productQuantity, const Date &productExpirationDate) {
+        Shard &shard = shardFor(productName);
+        unique_lock<shared_mutex> writing(shard.lock);
+        OperationStatus status = shard.fridge.tryInsert(productName, productQuantity, productExpirationDate);
+        if (status == OperationStatus::Ok) {
+            shard.version.fetch_add(1, memory_order_release);
+        }
+        return status;
+    }
+
+    // Method to consume a product from any thread. Only the product's shard is locked
+    OperationStatus consumeProduct(string_view productName, Quantity productQuantity) {
+        Shard &shard = shardFor(productName);
+        unique_lock<shared_mutex> writing(shard.lock);
+        OperationStatus status = shard.fridge.tryConsume(productName, productQuantity);
+        if (status == OperationStatus::Ok) {
+            shard.version.fetch_add(1, memory_order_release);
+        }
+        return status;
+    }
+
+    // Method to remove every expired lot, locking one shard at a time
+    PurgeCounts purgeExpired(const Date &currentDate) {
+        PurgeCounts counts;
+        for (auto &shard : shards) {
+            unique_lock<shared_mutex> writing(shard->lock);
+            PurgeCounts shardCounts = shard->fridge.purgeExpired(currentDate);
+            if (shardCounts.products > 0) {
+                shard->version.fetch_add(1, memory_order_release);
+            }
+            counts += shardCounts;
+        }
+        return counts;
+    }
+
+    // Method to sum the memory pool usage of all shards
+    PoolStats getMemoryStats() const {
+        PoolStats total;
+        auto add = [](MemoryStats &into, const MemoryStats &from) {
+            into.bytesInUse += from.bytesInUse;
+            into.peakBytesInUse += from.peakBytesInUse; // Sum of the per-shard peaks
+            into.allocations += from.allocations;
+            into.deallocations += from.deallocations;
+        };
+        for (const auto &shard : shards) {
+            shared_lock<shared_mutex> reading(shard->lock);
+            PoolStats stats = shard->pool.getStats();
+            add(total.used, stats.used);
+            add(total.reserved, stats.reserved);
+        }
+        return total;
+    }
+
+    // Method to take a read-only snapshot of the whole refrigerator without blocking any writer
+    RefrigeratorSnapshot snapshot() {
+        vector<shared_ptr<const ShardSnapshot>> shardSnapshots;
+        shardSnapshots.reserve(shards.size());
+        for (auto &shard : shards) {
+            shardSnapshots.push_back(snapshotShard(*shard));
+        }
+        return RefrigeratorSnapshot(move(shardSnapshots));
+    }
+
+    // Method to display the current status from a snapshot
+    void showStatus() {
+        RefrigeratorSnapshot view = snapshot();
+        lock_guard<mutex> guard(reportLock);
+        report << "\n--- Current Refrigerator Status ---\n";
+        if (view.getProductCount() == 0) {
+            report << "The refrigerator is empty.\n";
+        }
+        view.forEachProduct([&](const string &name, Quantity quantity, const Date &expiration, uint32_t lotCount) {
+            report << "- " << name << ": " << quantity << " (Expires: " << expiration;
+            if (lotCount > 1) {
+                report << ", " << lotCount << " lots";
+            }
+            report << ")\n";
+        });
+        report.endReport();
+    }
+
+    // Method to display the history of actions of all shards
+    void showHistory() {
+        lock_guard<mutex> guard(reportLock);
+        lock_guard<mutex> historyGuard(historyLock);
+        drainHistoryLocked();
+        report << "\n--- History of Actions ---\n";
+        if (history.empty()) {
+            report << "No actions recorded yet.\n";
+        }
+        for (const HistoryEvent &event : history) {
+            report << "- ";
+            describeAction(report, *catalog, event);
+            report << '\n';
+        }
+        report.endReport();
+    }
+
+    // Method to generate a shopping list from a snapshot. Every product lives in exactly one shard,
+    // so the per-shard totals need no merging
+    void generateShoppingList() {
+        RefrigeratorSnapshot view = snapshot();
+        lock_guard<mutex> guard(reportLock);
+        report << "\n--- Generated Shopping List ---\n";
+        bool empty = true;
+        view.forEachConsumption([&](const string &name, Quantity quantity) {
+            report << "- Buy more " << name << " (" << quantity << ")\n";
+            empty = false;
+        });
+        if (empty) {
+            report << "No items to suggest for shopping.\n";
+        }
+        report.endReport();
+    }
+
+    // Method to get a copy of the history log, including actions still queued
+    vector<HistoryEvent> getHistory() {
+        lock_guard<mutex> guard(historyLock);
+        drainHistoryLocked();
+        return history;
+    }
+};
+
+// One queued update of an IngestionPipeline, exactly one cache line so queueing it is a single copy.
+// Names of up to INLINE_NAME_CAPACITY characters are stored in the event itself; longer names are
+// copied to the heap (and freed by the applier)
+struct IngestEvent {
+    static constexpr size_t INLINE_NAME_CAPACITY = 27;
+
+    Quantity quantity;
+    promise<OperationStatus> *ack; // Fulfilled once the event is applied, or null if nobody waits for it
+    char *longName; // Heap copy of a name too long for `name`, else null
+    Date expirationDate; // Inserts only
+    uint32_t timestamp; // When the event was queued, as recorded in the history
+    uint32_t nameLength;
+    ActionType type;
+    char name[INLINE_NAME_CAPACITY];
+
+    string_view getName() const {
+        return {longName != nullptr ? longName : name, nameLength};
+    }
+};
+
+static_assert(sizeof(IngestEvent) == 64, "An IngestEvent should fill exactly one cache line");
+
+// Counters of an IngestionPipeline
+struct IngestionStats {
+    uint64_t events = 0; // Events applied
+    uint64_t batches = 0; // Batches they were applied in
+    uint64_t coalesced = 0; // Events merged into an earlier event of the same batch
+};
+
+// IngestionPipeline decouples the threads that report inserts and consumptions (scanners, doors) from
+// the Refrigerator. Producers only copy a fixed-size event into a lock-free MpscRing; a single applier
+// thread drains the ring in batches and applies them, so the hash table updates, history appends and
+// storage commits never run on a producer. An optional future reports the outcome of each event.
+//
+// Within a batch, repeated events on the same product are coalesced: consecutive deliveries of a product
+// with the same expiration date become one lot, and consecutive consumptions of a product are applied as
+// one (falling back to one at a time if the product runs out part way through). The history then holds
+// the merged quantity in a single entry. Events on one product are always applied in the order they
+// were queued; events on different products may be reordered within a batch.
+//
+// While the pipeline runs, the applier owns the refrigerator: read it only after flush() returned and
+// while no producer is submitting, or after the pipeline is destroyed.
+class IngestionPipeline {
+private:
+    static constexpr size_t MAX_BATCH = 4096; // Most events applied per storage commit
+
+    // A run of coalesced events, linked through `nextInGroup` in queue order
+    struct Group {
+        uint32_t first;
+        uint32_t last;
+        Quantity quantity; // Total of the members
+        uint32_t members;
+    };
+
+    Refrigerator &fridge;
+    MpscRing<IngestEvent> ring;
+    vector<IngestEvent> batch; // The events being applied; only touched by the applier
+    vector<Group> groups;
+    vector<uint32_t> nextInGroup;
+    vector<OperationStatus> results;
+    unordered_map<string_view, uint32_t> latestGroup; // Latest group of each product name in the batch
+    alignas(64) atomic<size_t> applied{0}; // Ring positions applied so far
+    atomic<uint32_t> wakeSignal{0}; // Bumped (and notified) to wake a sleeping applier
+    atomic<bool> idle{false}; // The applier is about to sleep, or sleeping, on wakeSignal
+    atomic<bool> stopping{false};
+    atomic<uint64_t> eventCount{0};
+    atomic<uint64_t> batchCount{0};
+    atomic<uint64_t> coalescedCount{0};
+    thread applier;
+
+    // Private helper function to wake the applier if it is sleeping
+    void wakeApplier() {
+        atomic_thread_fence(memory_order_seq_cst); // Pairs with the fence in applierLoop
+        if (idle.load(memory_order_relaxed)) {
+            wakeSignal.fetch_add(1, memory_order_release);
+            wakeSignal.notify_one();
+        }
+    }
+
+    // Private helper function to queue an event, waiting only while the ring is full
+    void enqueue(ActionType type, string_view productName, Quantity productQuantity, const Date &expirationDate,
+                 promise<OperationStatus> *ack) {
+        IngestEvent event;
+        event.quantity = productQuantity;
+        event.ack = ack;
+        event.longName = nullptr;
+        event.expirationDate = expirationDate;
+        event.timestamp = Refrigerator::currentTimestamp();
+        event.nameLength = static_cast<uint32_t>(productName.size());
+        event.type = type;
+        if (productName.size() <= IngestEvent::INLINE_NAME_CAPACITY) {
+            memcpy(event.name, productName.data(), productName.size());
+        } else {
+            event.longName = new char[productName.size()];
+            memcpy(event.longName, productName.data(), productName.size());
+        }
+
+        while (!ring.tryPush(event)) {
+            wakeApplier();
+            this_thread::yield(); // Back-pressure: the applier is behind by a whole ring
+        }
+        wakeApplier();
+    }
+
+    // Private helper function to queue an event and get a future for its outcome
+    future<OperationStatus> enqueueWithAck(ActionType type, string_view productName, Quantity productQuantity,
+                                           const Date &expirationDate) {
+        auto ack = make_unique<promise<OperationStatus>>();
+        future<OperationStatus> outcome = ack->get_future();
+        enqueue(type, productName, productQuantity, expirationDate, ack.get());
+        ack.release(); // Owned by the event now; the applier deletes it
+        return outcome;
+    }
+
+    // Private helper function to move up to MAX_BATCH queued events into the batch
+    bool drain() {
+        IngestEvent event;
+        while (batch.size() < MAX_BATCH && ring.tryPop(event)) {
+            batch.push_back(event);
+        }
+        return !batch.empty();
+    }
+
+    // Private helper function to sort the batch into groups of coalesced events. Events that fail
+    // validation get their result right away and join no group
+    void groupBatch() {
+        groups.clear();
+        latestGroup.clear();
+        nextInGroup.assign(batch.size(), UINT32_MAX);
+        results.assign(batch.size(), OperationStatus::Ok);
+        for (uint32_t index = 0; index < batch.size(); ++index) {
+            const IngestEvent &event = batch[index];
+            if (!event.quantity.isValid()) {
+                results[index] = OperationStatus::InvalidQuantity;
+                continue;
+            }
+            if (event.quantity <= 0) {
+                results[index] = OperationStatus::NonPositiveQuantity;
+                continue;
+            }
+            auto [it, added] = latestGroup.try_emplace(event.getName(), static_cast<uint32_t>(groups.size()));
+            if (!added) {
+                Group &group = groups[it->second];
+                const IngestEvent &head = batch[group.first];
+                if (head.type == event.type && !group.quantity.sumOverflows(event.quantity) &&
+                    (event.type == ActionType::Consume || head.expirationDate == event.expirationDate)) {
+                    nextInGroup[group.last] = index;
+                    group.last = index;
+                    group.quantity += event.quantity;
+                    ++group.members;
+                    continue;
+                }
+                it->second = static_cast<uint32_t>(groups.size()); // Later events of this product start here
+            }
+            groups.push_back({index, index, event.quantity, 1});
+        }
+    }
+
+    // Private helper function to apply one group, recording the outcome of each member. Returns the number
+    // of members merged into the first, which is zero when they had to be applied one at a time
+    uint32_t applyGroup(const Group &group) {
+        const IngestEvent &head = batch[group.first];
+        OperationStatus status;
+        if (head.type == ActionType::Insert) {
+            status = fridge.applyInsert(head.getName(), group.quantity, head.expirationDate, head.timestamp);
+            if (status == OperationStatus::QuantityOverflow && group.members > 1) {
+                // Too much for all of them: take them one at a time until the product is full
+                for (uint32_t index = group.first; index != UINT32_MAX; index = nextInGroup[index]) {
+                    const IngestEvent &event = batch[index];
+                    results[index] = fridge.applyInsert(event.getName(), event.quantity, event.expirationDate,
+                                                        event.timestamp);
+                }
+                return 0;
+            }
+        } else {
+            status = fridge.applyConsume(head.getName(), group.quantity, head.timestamp);
+            if (status == OperationStatus::NotEnoughQuantity && group.members > 1) {
+                // Not enough for all of them: serve them one at a time, as if they had not been merged
+                for (uint32_t index = group.first; index != UINT32_MAX; index = nextInGroup[index]) {
+                    const IngestEvent &event = batch[index];
+                    results[index] = fridge.applyConsume(event.getName(), event.quantity, event.timestamp);
+                }
+                return 0;
+            }
+        }
+        for (uint32_t index = group.first; index != UINT32_MAX; index = nextInGroup[index]) {
+            results[index] = status;
+        }
+        return group.members - 1;
+    }
+
+    // Private helper function to apply the batch, commit it and report the outcomes
+    void applyBatch() {
+        uint64_t coalesced = 0;
+        {
+            auto timer = fridge.metrics.time(MetricOperation::Batch);
+            groupBatch();
+            fridge.reserveForBatch(groups.size());
+            for (const Group &group : groups) {
+                coalesced += applyGroup(group);
+            }
+            fridge.commitStorage(); // One commit for the whole batch, before anyone is told it is done
+        }
+
+        for (size_t index = 0; index < batch.size(); ++index) {
+            IngestEvent &event = batch[index];
+            if (event.ack != nullptr) {
+                event.ack->set_value(results[index]);
+                delete event.ack;
+            }
+            delete[] event.longName;
+        }
+        eventCount.fetch_add(batch.size(), memory_order_relaxed);
+        batchCount.fetch_add(1, memory_order_relaxed);
+        coalescedCount.fetch_add(coalesced, memory_order_relaxed);
+        applied.fetch_add(batch.size(), memory_order_release);
+        applied.notify_all();
+        batch.clear();
+    }
+
+    // Private helper function run by the applier thread
+    void applierLoop() {
+        while (true) {
+            if (drain()) {
+                applyBatch();
+                continue;
+            }
+
+            // Nothing queued: announce that we are going to sleep, then look once more, so a producer
+            // either sees the announcement and wakes us or its event is found by this second look
+            uint32_t ticket = wakeSignal.load(memory_order_acquire);
+            idle.store(true, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (drain()) {
+                idle.store(false, memory_order_relaxed);
+                applyBatch();
+                continue;
+            }
+            if (stopping.load(memory_order_acquire)) {
+                return;
+            }
+            wakeSignal.wait(ticket, memory_order_acquire);
+            idle.store(false, memory_order_relaxed);
+        }
+    }
+
+public:
+    // Constructor to start the applier for a refrigerator, with room for at least `capacity` queued events
+    explicit IngestionPipeline(Refrigerator &target, size_t capacity = 65536)
+        : fridge(target), ring(capacity) {
+        batch.reserve(MAX_BATCH);
+        results.reserve(MAX_BATCH);
+        nextInGroup.reserve(MAX_BATCH);
+        groups.reserve(MAX_BATCH);
+        latestGroup.reserve(MAX_BATCH);
+        applier = thread([this] { applierLoop(); });
+    }
+
+    IngestionPipeline(const IngestionPipeline &) = delete;
+    IngestionPipeline &operator=(const IngestionPipeline &) = delete;
+
+    // Destructor to apply everything still queued and stop the applier. No producer may still be submitting
+    ~IngestionPipeline() {
+        stopping.store(true, memory_order_release);
+        wakeSignal.fetch_add(1, memory_order_release);
+        wakeSignal.notify_one();
+        applier.join();
+    }
+
+    // Method to queue an insertion from any thread, without waiting for it to be applied
+    void insertProduct(string_view productName, Quantity productQuantity, const Date &productExpirationDate) {
+        enqueue(ActionType::Insert, productName, productQuantity, productExpirationDate, nullptr);
+    }
+
+    // Method to queue a consumption from any thread, without waiting for it to be applied
+    void consumeProduct(string_view productName, Quantity productQuantity) {
+        enqueue(ActionType::Consume, productName, productQuantity, Date(), nullptr);
+    }
+
+    // Method to queue an insertion and get a future that receives its outcome once it is applied
+    // (and committed, if the refrigerator has storage)
+    future<OperationStatus> insertProductAsync(string_view productName, Quantity productQuantity,
+                                               const Date &productExpirationDate) {
+        return enqueueWithAck(ActionType::Insert, productName, productQuantity, productExpirationDate);
+    }
+
+    // Method to queue a consumption and get a future that receives its outcome once it is applied
+    future<OperationStatus> consumeProductAsync(string_view productName, Quantity productQuantity) {
+        return enqueueWithAck(ActionType::Consume, productName, productQuantity, Date());
+    }
+
+    // Method to wait until every event queued before the call (by any thread) has been applied
+    void flush() {
+        size_t target = ring.getPushCount();
+        size_t done = applied.load(memory_order_acquire);
+        while (done < target) {
+            applied.wait(done, memory_order_acquire);
+            done = applied.load(memory_order_acquire);
+        }
+    }
+
+    // Getter method to retrieve the counters of the events applied so far
+    IngestionStats getStats() const {
+        IngestionStats stats;
+        stats.events = eventCount.load(memory_order_relaxed);
+        stats.batches = batchCount.load(memory_order_relaxed);
+        stats.coalesced = coalescedCount.load(memory_order_relaxed);
+        return stats;
+    }
+};
+
+// Per-product totals across the refrigerators of a fleet
+struct FleetProductTotal {
+    Quantity quantity;
+    Date earliestExpiration; // Earliest lot among the counted quantity
+    uint32_t refrigeratorCount = 0; // How many refrigerators contributed
+};
+
+// Fleet owns many Refrigerators (one per unit) sharing one product catalog, and answers questions about
+// all of them at once by spreading the units over a work-stealing thread pool. Each pool thread merges
+// into its own partial result, and the partials are merged per product at the end. The refrigerators
+// must not be changed by other threads while a fleet query runs.
+class Fleet {
+private:
+    shared_ptr<ProductCatalog> catalog; // Shared by all units, so product ids mean the same everywhere
+    vector<unique_ptr<Refrigerator>> refrigerators;
+    WorkStealingPool pool;
+    ReportWriter report;
+
+    // Private helper function to merge per-product totals of one slot into the overall result
+    static void mergeTotals(unordered_map<ProductId, FleetProductTotal> &into,
+                            const unordered_map<ProductId, FleetProductTotal> &from) {
+        for (const auto &item : from) {
+            auto inserted = into.try_emplace(item.first, item.second);
+            if (inserted.second) {
+                continue;
+            }
+            FleetProductTotal &total = inserted.first->second;
+            total.quantity += item.second.quantity;
+            total.earliestExpiration = min(total.earliestExpiration, item.second.earliestExpiration);
+            total.refrigeratorCount += item.second.refrigeratorCount;
+        }
+    }
+
+    // Private helper function to add one refrigerator's share of a product to a partial result
+    static void addTotal(unordered_map<ProductId, FleetProductTotal> &partial, ProductId productId, Quantity quantity,
+                         const Date &earliest) {
+        auto inserted = partial.try_emplace(productId, FleetProductTotal{quantity, earliest, 1});
+        if (!inserted.second) {
+            FleetProductTotal &total = inserted.first->second;
+            total.quantity += quantity;
+            total.earliestExpiration = min(total.earliestExpiration, earliest);
+            ++total.refrigeratorCount;
+        }
+    }
+
+    // Private helper function to run collect(refrigerator, partial) over every unit in parallel and merge
+    template <typename Partial, typename Collect, typename Merge>
+    Partial gather(Collect collect, Merge merge) {
+        vector<Partial> partials(pool.getWorkerCount() + 1);
+        pool.parallelFor(refrigerators.size(), [&](size_t index, size_t slot) {
+            collect(*refrigerators[index], partials[slot]);
+        });
+        Partial result;
+        for (const Partial &partial : partials) {
+            merge(result, partial);
+        }
+        return result;
+    }
+
+    // Private helper function to print per-product totals under a title
+    void printTotals(string_view title, const unordered_map<ProductId, FleetProductTotal> &totals,
+                     string_view emptyMessage) {
+        report << "\n--- " << title << " ---\n";
+        if (totals.empty()) {
+            report << emptyMessage << '\n';
+        }
+        for (const auto &item : totals) {
+            report << "- " << catalog->getName(item.first) << ": " << item.second.quantity
+                   << " (Expires: " << item.second.earliestExpiration << ", in " << item.second.refrigeratorCount
+                   << (item.second.refrigeratorCount == 1 ? " refrigerator)\n" : " refrigerators)\n");
+        }
+        report.endReport();
+    }
+
+public:
+    // Constructor to create an empty fleet with `threadCount` pool threads (one per hardware thread if zero)
+    explicit Fleet(size_t threadCount = 0, shared_ptr<ProductCatalog> sharedCatalog = make_shared<ProductCatalog>())
+        : catalog(move(sharedCatalog)), pool(threadCount) {}
+
+    // Method to add a new, empty refrigerator to the fleet. The reference stays valid for the fleet's lifetime
+    Refrigerator &addRefrigerator() {
+        refrigerators.push_back(make_unique<Refrigerator>(catalog));
+        return *refrigerators.back();
+    }
+
+    // Getter method to retrieve one refrigerator of the fleet
+    Refrigerator &getRefrigerator(size_t index) {
+        return *refrigerators[index];
+    }
+
+    // Getter method to retrieve the number of refrigerators in the fleet
+    size_t size() const {
+        return refrigerators.size();
+    }
+
+    // Getter method to retrieve the product catalog shared by the refrigerators
+    const ProductCatalog &getCatalog() const {
+        return *catalog;
+    }
+
+    // Getter method to retrieve the writer used by the fleet reports
+    ReportWriter &getReportWriter() {
+        return report;
+    }
+
+    // Method to find, per product, how much expires on or before a date anywhere in the fleet.
+    // Nothing is removed
+    unordered_map<ProductId, FleetProductTotal> findExpiring(const Date &date) {
+        using Totals = unordered_map<ProductId, FleetProductTotal>;
+        return gather<Totals>(
+            [&](Refrigerator &fridge, Totals &partial) {
+                for (const ExpiringItem &item : fridge.findExpiring(date)) {
+                    addTotal(partial, item.productId, item.expiringQuantity, item.earliestExpiration);
+                }
+            },
+            mergeTotals);
+    }
+
+    // Method to total the stock of every product across the fleet
+    unordered_map<ProductId, FleetProductTotal> getStockTotals() {
+        using Totals = unordered_map<ProductId, FleetProductTotal>;
+        return gather<Totals>(
+            [](Refrigerator &fridge, Totals &partial) {
+                const FlatProductStore &products = fridge.products;
+                for (uint32_t slot = 0; slot < products.size(); ++slot) {
+                    addTotal(partial, products.getId(slot), products.getQuantity(slot),
+                             products.getExpirationDate(slot));
+                }
+            },
+            mergeTotals);
+    }
+
+    // Method to total the consumption of every product across the fleet
+    unordered_map<ProductId, Quantity> getConsumptionTotals() {
+        using Totals = unordered_map<ProductId, Quantity>;
+        auto merge = [](Totals &into, const auto &from) {
+            for (const auto &item : from) {
+                into[item.first] += item.second;
+            }
+        };
+        return gather<Totals>(
+            [&](Refrigerator &fridge, Totals &partial) { merge(partial, fridge.consumedTotals); }, merge);
+    }
+
+    // Method to remove every expired lot in every refrigerator, in parallel, summing the counts
+    PurgeCounts purgeExpired(const Date &currentDate) {
+        vector<PurgeCounts> partials(pool.getWorkerCount() + 1);
+        pool.parallelFor(refrigerators.size(), [&](size_t index, size_t slot) {
+            partials[slot] += refrigerators[index]->purgeExpired(currentDate);
+        });
+        PurgeCounts counts;
+        for (const PurgeCounts &partial : partials) {
+            counts += partial;
+        }
+        return counts;
+    }
+
+    // Method to display the stock of the whole fleet
+    void showStatus() {
+        printTotals("Fleet Status", getStockTotals(), "Every refrigerator is empty.");
+    }
+
+    // Method to display what expires on or before a date anywhere in the fleet
+    void showExpiring(const Date &date) {
+        printTotals("Expiring by " + date.toString(), findExpiring(date), "Nothing expires by then.");
+    }
+
+    // Method to generate one shopping list from the consumption of the whole fleet
+    void generateShoppingList() {
+        unordered_map<ProductId, Quantity> totals = getConsumptionTotals();
+        report << "\n--- Fleet Shopping List ---\n";
+        if (totals.empty()) {
+            report << "No items to suggest for shopping.\n";
+        }
+        for (const auto &item : totals) {
+            report << "- Buy more " << catalog->getName(item.first) << " (" << item.second << ")\n";
+        }
+        report.endReport();
+    }
+};
+
+// Requests understood by a FridgeServer. Every frame, in either direction, is
+//   [size u32][request id u32][opcode or status u8][body]
+// with `size` counting the bytes after itself. Values are encoded by BinaryWriter, like the WAL records:
+// integers little-endian on every host, a string is [length u32][bytes], a quantity is i64 milli-units
+// and a date is u32 days since 1970-01-01.
+// The response echoes the request id; responses come back in request order, so a client can send many
+// requests without waiting (pipelining).
+//   Insert (1)        request: name, quantity, expiration date
+//   Consume (2)       request: name, quantity
+//   Status (3)        response: count u32, then per product: name, quantity, earliest expiration, lots u32
+//   Expirations (4)   request: date, purge u8
+//                     response: count u32, then per product with lots expiring by the date: name,
+//                     expiring quantity, remaining quantity, earliest expiration. With purge set, those
+//                     lots are then removed
+//   ShoppingList (5)  request: days u32 (0 for all time)
+//                     response: count u32, then per product: name, consumed quantity
+//   Subscribe (6)     request: watched u8 (CHANGE_* bits), interval in milliseconds u32
+//                     response: subscription id u32. From then on, every interval with changes brings a
+//                     frame with the Subscribe request's id and status Changes: count u32, then per
+//                     product: name, changes u8, quantity, earliest expiration, lots u32 (see ProductChange)
+//   Unsubscribe (7)   request: subscription id u32 (one made on the same connection)
+enum class ServerOpcode : uint8_t {
+    Insert = 1,
+    Consume = 2,
+    Status = 3,
+    Expirations = 4,
+    ShoppingList = 5,
+    Subscribe = 6,
+    Unsubscribe = 7
+};
+
+// Status byte of a FridgeServer response: the OperationStatus of an insert or consume, Ok for the
+// queries, InvalidName / InvalidDate for a request with an empty product name or a date past
+// Date::MAX_DAYS, BadRequest for a request that cannot be decoded, or Changes for a subscription delivery
+enum class ServerStatus : uint8_t {
+    Ok = static_cast<uint8_t>(OperationStatus::Ok),
+    NonPositiveQuantity = static_cast<uint8_t>(OperationStatus::NonPositiveQuantity),
+    ProductNotFound = static_cast<uint8_t>(OperationStatus::ProductNotFound),
+    NotEnoughQuantity = static_cast<uint8_t>(OperationStatus::NotEnoughQuantity),
+    InvalidQuantity = static_cast<uint8_t>(OperationStatus::InvalidQuantity),
+    QuantityOverflow = static_cast<uint8_t>(OperationStatus::QuantityOverflow),
+    InvalidName = 252,
+    InvalidDate = 253,
+    Changes = 254,
+    BadRequest = 255
+};
+
+// Counters of a FridgeServer
+struct ServerStats {
+    uint64_t connections = 0; // Connections accepted
+    uint64_t requests = 0; // Requests answered (including bad ones)
+    uint64_t batches = 0; // insertBatch / consumeBatch calls the inserts and consumes were grouped into
+    uint64_t deliveries = 0; // Change frames pushed to subscribers
+};
+
+// FridgeServer exposes a Refrigerator over TCP or a Unix socket with the binary protocol above. One thread
+// runs an epoll loop over non-blocking sockets; the refrigerator is only touched from that thread. When a
+// connection becomes readable, every complete frame it sent is handled in one go: consecutive inserts (or
+// consumes) become a single insertBatch (consumeBatch) call, so they share one WAL commit, and all the
+// responses are appended to the connection's output buffer and sent with one write. A client whose
+// responses pile up unread is not read from until they drain.
+class FridgeServer {
+public:
+    static constexpr size_t MAX_FRAME_BYTES = 1 << 20; // Larger requests close the connection
+    static constexpr size_t MAX_PENDING_OUTPUT = 4 << 20; // Unsent response bytes that pause reading
+
+private:
+    struct Connection {
+        int descriptor;
+        string input; // Received bytes not yet handled (at most one partial frame after handleInput)
+        BinaryWriter output; // Encoded responses; the first `sent` bytes are already written
+        size_t sent = 0;
+        uint32_t events = 0; // Events currently registered with epoll
+        bool closing = false; // Close once the output is sent (protocol error)
+        vector<SubscriptionId> subscriptions; // Cancelled when the connection closes
+    };
+
+    Refrigerator &fridge;
+    int listenDescriptor = -1;
+    int epollDescriptor = -1;
+    int wakeDescriptor = -1; // eventfd written by stop()
+    string socketPath; // Unix socket file to remove on close, if listening on one
+    unordered_map<int, unique_ptr<Connection>> connections;
+    atomic<bool> stopping{false};
+    ServerStats stats;
+    string lastError;
+
+    // A run of consecutive inserts or consumes of one connection, applied together (see flushRun)
+    vector<InsertRecord> insertRun;
+    vector<ConsumeRecord> consumeRun;
+    vector<uint32_t> runIds; // Request ids of the run, in order
+    BinaryWriter body; // Scratch buffer for the body of one response
+    vector<int> notified; // Connections handed changes by the last deliverChanges, to be written out
+
+    // Private helper function to remember why an operation failed
+    bool fail(const string &message) {
+        lastError = message + ": " + strerror(errno);
+        return false;
+    }
+
+    // Private helper function to append a frame with `body` as its body to a connection's output
+    void writeFrame(Connection &connection, uint32_t requestId, ServerStatus status) {
+        connection.output.put(static_cast<uint32_t>(sizeof(requestId) + sizeof(status) + body.size()));
+        connection.output.put(requestId);
+        connection.output.put(status);
+        connection.output.putBytes(body.getBytes());
+        body.clear();
+    }
+
+    // Private helper function to append the response to a request
+    void respond(Connection &connection, uint32_t requestId, ServerStatus status) {
+        writeFrame(connection, requestId, status);
+        ++stats.requests;
+    }
+
+    bool listenUnix(const string &path);
+    bool listenTcp(const string &host, const string &port);
+    bool watch(int descriptor, uint32_t events, int operation);
+    void acceptConnections();
+    // Private helper functions that handle a ready connection; they return false once it has been closed
+    bool handleReadable(Connection &connection);
+    bool sendOutput(Connection &connection);
+    void handleInput(Connection &connection);
+    void handleRequest(Connection &connection, BinaryReader &request);
+    void flushRun(Connection &connection);
+    void writeStatus();
+    ServerStatus writeExpirations(BinaryReader &request);
+    bool writeShoppingList(BinaryReader &request);
+    bool subscribe(Connection &connection, uint32_t requestId, BinaryReader &request);
+    bool unsubscribe(Connection &connection, BinaryReader &request);
+    chrono::steady_clock::time_point deliverChanges();
+    void updateEvents(Connection &connection);
+    void closeConnection(int descriptor);
+
+public:
+    // Constructor to serve a refrigerator; call listen() and then run()
+    explicit FridgeServer(Refrigerator &target) : fridge(target) {}
+
+    FridgeServer(const FridgeServer &) = delete;
+    FridgeServer &operator=(const FridgeServer &) = delete;
+
+    ~FridgeServer() {
+        close();
+    }
+
+    // Method to start listening on "unix:<path>" or "<host>:<port>" (an empty host listens on every
+    // interface; port 0 picks a free one, see getPort). Returns false (see getLastError) on failure
+    bool listen(const string &address);
+
+    // Method to serve clients until stop() is called. Returns false (see getLastError) if the event
+    // loop itself fails; a misbehaving client only loses its own connection
+    bool run();
+
+    // Method to make run() return. Safe to call from another thread or a signal handler
+    void stop() {
+        stopping.store(true, memory_order_relaxed);
+        uint64_t one = 1;
+        ssize_t written = ::write(wakeDescriptor, &one, sizeof(one));
+        (void)written; // Nothing useful (or signal-safe) to do if it fails; run() rechecks `stopping`
+    }
+
+    // Method to close the listening socket and every connection
+    void close();
+
+    // Getter method to retrieve the TCP port listened on (0 for a Unix socket)
+    uint16_t getPort() const;
+
+    // Getter method to retrieve the counters
+    const ServerStats &getStats() const {
+        return stats;
+    }
+
+    // Getter method to retrieve the reason of the last failure
+    const string &getLastError() const {
+        return lastError;
+    }
+};
+
+#endif // FRIDGE_H
@@ -0,0 +1,446 @@
+// Benchmarks for the refrigerator hot paths: insert/consume throughput, the expiration sweep, shopping-list
+// generation and the memory used per product. Run e.g. `./fridge_benchmark --benchmark_filter=Sweep`;
+// the 10M-product cases need about 1 GB of memory.
+#include "fridge.h"
+
+#include <benchmark/benchmark.h>
+
+#include <cstdlib>
+#include <new>
+#include <random>
+
+// Bytes currently allocated through operator new, for the memory footprint benchmark. Every block carries
+// a header holding its size, so the count stays exact without relying on the allocator
+static atomic<size_t> allocatedBytes{0};
+
+static constexpr size_t ALLOCATION_HEADER = alignof(max_align_t);
+
+void *operator new(size_t size) {
+    void *block = malloc(size + ALLOCATION_HEADER);
+    if (block == nullptr) {
+        throw bad_alloc();
+    }
+    *static_cast<size_t *>(block) = size;
+    allocatedBytes.fetch_add(size, memory_order_relaxed);
+    return static_cast<char *>(block) + ALLOCATION_HEADER;
+}
+
+void operator delete(void *pointer) noexcept {
+    if (pointer == nullptr) {
+        return;
+    }
+    void *block = static_cast<char *>(pointer) - ALLOCATION_HEADER;
+    allocatedBytes.fetch_sub(*static_cast<size_t *>(block), memory_order_relaxed);
+    free(block);
+}
+
+void operator delete(void *pointer, size_t) noexcept {
+    operator delete(pointer);
+}
+
+// Over-aligned blocks (polymorphic allocators ask for these) keep the size just before the returned pointer
+void *operator new(size_t size, align_val_t alignment) {
+    size_t offset = max(static_cast<size_t>(alignment), ALLOCATION_HEADER);
+    size_t total = (size + offset + static_cast<size_t>(alignment) - 1) & ~(static_cast<size_t>(alignment) - 1);
+    char *block = static_cast<char *>(aligned_alloc(static_cast<size_t>(alignment), total));
+    if (block == nullptr) {
+        throw bad_alloc();
+    }
+    *reinterpret_cast<size_t *>(block + offset - sizeof(size_t)) = size;
+    allocatedBytes.fetch_add(size, memory_order_relaxed);
+    return block + offset;
+}
+
+void operator delete(void *pointer, align_val_t alignment) noexcept {
+    if (pointer == nullptr) {
+        return;
+    }
+    size_t offset = max(static_cast<size_t>(alignment), ALLOCATION_HEADER);
+    char *block = static_cast<char *>(pointer) - offset;
+    allocatedBytes.fetch_sub(*reinterpret_cast<size_t *>(block + offset - sizeof(size_t)), memory_order_relaxed);
+    free(block);
+}
+
+void operator delete(void *pointer, size_t, align_val_t alignment) noexcept {
+    operator delete(pointer, alignment);
+}
+
+namespace {
+
+// WorkloadGenerator produces a reproducible synthetic workload over a fixed set of product names:
+// deliveries spread over the coming month and small consumptions
+class WorkloadGenerator {
+private:
+    mt19937_64 random;
+    vector<string> names;
+    uint32_t today;
+
+public:
+    explicit WorkloadGenerator(size_t productCount, uint64_t seed = 42)
+        : random(seed), today(Date::today().getDays()) {
+        names.reserve(productCount);
+        for (size_t i = 0; i < productCount; ++i) {
+            names.push_back("product-" + to_string(i));
+        }
+    }
+
+    size_t getProductCount() const {
+        return names.size();
+    }
+
+    const string &getName(size_t index) const {
+        return names[index];
+    }
+
+    string_view randomName() {
+        return names[random() % names.size()];
+    }
+
+    // Expiration between tomorrow and `spanDays` days from now
+    Date randomExpiration(uint32_t spanDays = 30) {
+        return Date(today + 1 + static_cast<uint32_t>(random() % spanDays));
+    }
+
+    double randomQuantity() {
+        return 1 + static_cast<double>(random() % 10);
+    }
+
+    // One delivery per product, in name order
+    vector<InsertRecord> stockingRecords(uint32_t spanDays = 30) {
+        vector<InsertRecord> records;
+        records.reserve(names.size());
+        for (const string &name : names) {
+            records.push_back({name, randomQuantity(), randomExpiration(spanDays)});
+        }
+        return records;
+    }
+
+    // Deliveries of random products
+    vector<InsertRecord> insertRecords(size_t count) {
+        vector<InsertRecord> records;
+        records.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            records.push_back({randomName(), randomQuantity(), randomExpiration()});
+        }
+        return records;
+    }
+
+    // Small consumptions of random products
+    vector<ConsumeRecord> consumeRecords(size_t count) {
+        vector<ConsumeRecord> records;
+        records.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            records.push_back({randomName(), 0.25});
+        }
+        return records;
+    }
+
+    uint32_t getToday() const {
+        return today;
+    }
+};
+
+// A stream that discards everything, so the reports are formatted but not printed
+class NullBuffer : public streambuf {
+protected:
+    int overflow(int character) override {
+        return character;
+    }
+
+    streamsize xsputn(const char *, streamsize count) override {
+        return count;
+    }
+};
+
+NullBuffer nullBuffer;
+ostream nullStream(&nullBuffer);
+
+// Function to create a refrigerator (of any configuration) whose reports go nowhere
+template <typename Fridge = Refrigerator>
+unique_ptr<Fridge> makeQuietRefrigerator() {
+    auto fridge = make_unique<Fridge>();
+    fridge->getReportWriter().setOutput(nullStream);
+    fridge->getReportWriter().setFlushPolicy(FlushPolicy::Manual);
+    return fridge;
+}
+
+// A refrigerator (of any configuration) stocked with one lot of each of `productCount` products, expiring
+// over the next `spanDays` days, built once per size and shared by the benchmarks that leave it as they found it
+template <typename Fridge = Refrigerator>
+struct StockedRefrigerator {
+    WorkloadGenerator workload;
+    vector<InsertRecord> stock;
+    unique_ptr<Fridge> fridge;
+
+    StockedRefrigerator(size_t productCount, uint32_t spanDays)
+        : workload(productCount), stock(workload.stockingRecords(spanDays)), fridge(makeQuietRefrigerator<Fridge>()) {
+        if constexpr (requires { fridge->setHistoryRecording(false); }) {
+            fridge->setHistoryRecording(false);
+        }
+        fridge->insertBatch(stock);
+    }
+};
+
+template <typename Fridge = Refrigerator>
+StockedRefrigerator<Fridge> &getStockedRefrigerator(size_t productCount, uint32_t spanDays = 30) {
+    static map<pair<size_t, uint32_t>, unique_ptr<StockedRefrigerator<Fridge>>> cache;
+    auto &entry = cache[{productCount, spanDays}];
+    if (!entry) {
+        cache.clear(); // Keep only one large refrigerator of each configuration alive at a time
+        auto &created = cache[{productCount, spanDays}];
+        created = make_unique<StockedRefrigerator<Fridge>>(productCount, spanDays);
+        return *created;
+    }
+    return *entry;
+}
+
+// Insertion of `range(0)` new products into an empty refrigerator
+void BM_InsertNewProducts(benchmark::State &state) {
+    WorkloadGenerator workload(static_cast<size_t>(state.range(0)));
+    vector<InsertRecord> records = workload.stockingRecords();
+    for (auto _ : state) {
+        auto fridge = makeQuietRefrigerator();
+        for (const InsertRecord &record : records) {
+            fridge->insertProduct(record.productName, record.quantity, record.expirationDate);
+        }
+        benchmark::DoNotOptimize(fridge.get());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_InsertNewProducts)->Arg(1000)->Arg(100000)->Unit(benchmark::kMicrosecond);
+
+// Further deliveries (new lots) of products already in a refrigerator of `range(0)` products
+void BM_InsertExistingProducts(benchmark::State &state) {
+    WorkloadGenerator workload(static_cast<size_t>(state.range(0)));
+    auto fridge = makeQuietRefrigerator();
+    fridge->insertBatch(workload.stockingRecords());
+    vector<InsertRecord> records = workload.insertRecords(1 << 16);
+    size_t next = 0;
+    for (auto _ : state) {
+        const InsertRecord &record = records[next++ & (records.size() - 1)];
+        fridge->insertProduct(record.productName, record.quantity, record.expirationDate);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_InsertExistingProducts)->Arg(1000)->Arg(100000);
+
+// Consumption from a refrigerator of `range(0)` products that never runs out, with the full default
+// configuration and with the minimal one (no history, no top-K orderings)
+template <typename Fridge>
+void BM_ConsumeProducts(benchmark::State &state) {
+    WorkloadGenerator workload(static_cast<size_t>(state.range(0)));
+    auto fridge = makeQuietRefrigerator<Fridge>();
+    for (size_t i = 0; i < workload.getProductCount(); ++i) {
+        fridge->insertProduct(workload.getName(i), 1e12, workload.randomExpiration());
+    }
+    vector<ConsumeRecord> records = workload.consumeRecords(1 << 16);
+    size_t next = 0;
+    for (auto _ : state) {
+        const ConsumeRecord &record = records[next++ & (records.size() - 1)];
+        fridge->consumeProduct(record.productName, record.quantity);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_ConsumeProducts, Refrigerator)->Arg(1000)->Arg(100000);
+BENCHMARK_TEMPLATE(BM_ConsumeProducts, CompactRefrigerator)->Arg(1000)->Arg(100000);
+
+// Deliveries queued through an IngestionPipeline from `threads` producers. The CPU time per item is what a
+// producer pays; the wall time is bounded by the applier once the ring is full
+void BM_IngestInsert(benchmark::State &state) {
+    static unique_ptr<Refrigerator> fridge;
+    static unique_ptr<IngestionPipeline> pipeline;
+    static vector<InsertRecord> records;
+    static WorkloadGenerator workload(100000);
+    if (state.thread_index() == 0) {
+        fridge = makeQuietRefrigerator();
+        fridge->insertBatch(workload.stockingRecords());
+        records = workload.insertRecords(1 << 16);
+        pipeline = make_unique<IngestionPipeline>(*fridge);
+    }
+    size_t next = static_cast<size_t>(state.thread_index()) * 4099;
+    for (auto _ : state) {
+        const InsertRecord &record = records[next++ & (records.size() - 1)];
+        pipeline->insertProduct(record.productName, record.quantity, record.expirationDate);
+    }
+    state.SetItemsProcessed(state.iterations());
+    if (state.thread_index() == 0) {
+        pipeline->flush();
+        state.counters["coalesced"] = static_cast<double>(pipeline->getStats().coalesced);
+        pipeline.reset();
+        fridge.reset();
+    }
+}
+BENCHMARK(BM_IngestInsert)->Threads(1)->Threads(4);
+
+// The expiration sweep kernel alone over `range(0)` packed dates, about one in thirty of them expired,
+// with the kernel picked for this CPU and with the scalar loop it falls back to
+template <bool Scalar>
+void BM_SweepExpired(benchmark::State &state) {
+    WorkloadGenerator workload(1);
+    vector<uint32_t> days(static_cast<size_t>(state.range(0)));
+    for (uint32_t &day : days) {
+        day = workload.randomExpiration().getDays();
+    }
+    uint32_t tomorrow = workload.getToday() + 1;
+    vector<uint64_t> mask;
+    for (auto _ : state) {
+        size_t expired;
+        if constexpr (Scalar) {
+            mask.assign((days.size() + 63) / 64, 0);
+            expired = sweepExpiredScalar(days.data(), 0, days.size(), tomorrow, mask.data());
+        } else {
+            expired = sweepExpired(days.data(), days.size(), tomorrow, mask);
+        }
+        benchmark::DoNotOptimize(expired);
+        benchmark::DoNotOptimize(mask.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_TEMPLATE(BM_SweepExpired, false)->Arg(1000)->Arg(100000)->Arg(10000000)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_SweepExpired, true)->Arg(1000)->Arg(100000)->Arg(10000000)->Unit(benchmark::kMicrosecond);
+
+// Read-only expiration query over `range(0)` products expiring over the next 1000 days, of which those
+// expiring within `range(1)` days match. The default store walks its expiration heap up to
+// 1/DENSE_SWEEP_FRACTION matches (the first two cases) and sweeps past that; the compact store always sweeps
+template <typename Fridge>
+void BM_ExpirationSweep(benchmark::State &state) {
+    StockedRefrigerator<Fridge> &stocked = getStockedRefrigerator<Fridge>(static_cast<size_t>(state.range(0)), 1000);
+    Date date(stocked.workload.getToday() + static_cast<uint32_t>(state.range(1)));
+    for (auto _ : state) {
+        Quantity expiring;
+        for (const ExpiringItem &item : stocked.fridge->findExpiring(date)) {
+            expiring += item.expiringQuantity;
+        }
+        benchmark::DoNotOptimize(expiring);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_TEMPLATE(BM_ExpirationSweep, Refrigerator)
+    ->ArgsProduct({{1000, 100000, 10000000}, {1, 4, 16, 64}})
+    ->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_ExpirationSweep, CompactRefrigerator)
+    ->ArgsProduct({{1000, 100000}, {1, 4, 16, 64}})
+    ->Unit(benchmark::kMicrosecond);
+
+// checkExpirations over `range(0)` products, removing (and reporting) about one in thirty of them, with
+// the default configuration (expiration heap) and the compact one (sweep). The removed products are
+// restocked outside the timed region
+template <typename Fridge>
+void BM_CheckExpirations(benchmark::State &state) {
+    StockedRefrigerator<Fridge> &stocked = getStockedRefrigerator<Fridge>(static_cast<size_t>(state.range(0)));
+    Date tomorrow(stocked.workload.getToday() + 1);
+    vector<InsertRecord> expiring;
+    for (const InsertRecord &record : stocked.stock) {
+        if (record.expirationDate <= tomorrow) {
+            expiring.push_back(record);
+        }
+    }
+    for (auto _ : state) {
+        stocked.fridge->checkExpirations(tomorrow);
+        state.PauseTiming();
+        stocked.fridge->getReportWriter().flush();
+        stocked.fridge->insertBatch(expiring);
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_TEMPLATE(BM_CheckExpirations, Refrigerator)->Arg(1000)->Arg(100000)->Arg(10000000)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_CheckExpirations, CompactRefrigerator)->Arg(1000)->Arg(100000)->Unit(benchmark::kMicrosecond);
+
+// Shopping list over 500 products after `range(0)` consumptions, from the running totals
+void BM_ShoppingList(benchmark::State &state) {
+    WorkloadGenerator workload(500);
+    auto fridge = makeQuietRefrigerator();
+    for (size_t i = 0; i < workload.getProductCount(); ++i) {
+        fridge->insertProduct(workload.getName(i), 1e12, workload.randomExpiration());
+    }
+    fridge->consumeBatch(workload.consumeRecords(static_cast<size_t>(state.range(0))));
+    for (auto _ : state) {
+        fridge->generateShoppingList();
+        fridge->getReportWriter().flush();
+    }
+    state.counters["history_length"] = static_cast<double>(state.range(0));
+}
+BENCHMARK(BM_ShoppingList)->Arg(1000)->Arg(100000)->Arg(1000000);
+
+// The same, restricted to the last seven days through the daily consumption buckets
+void BM_ShoppingListWindow(benchmark::State &state) {
+    WorkloadGenerator workload(500);
+    auto fridge = makeQuietRefrigerator();
+    for (size_t i = 0; i < workload.getProductCount(); ++i) {
+        fridge->insertProduct(workload.getName(i), 1e12, workload.randomExpiration());
+    }
+    fridge->consumeBatch(workload.consumeRecords(static_cast<size_t>(state.range(0))));
+    for (auto _ : state) {
+        fridge->generateShoppingList(7);
+        fridge->getReportWriter().flush();
+    }
+    state.counters["history_length"] = static_cast<double>(state.range(0));
+}
+BENCHMARK(BM_ShoppingListWindow)->Arg(1000)->Arg(100000)->Arg(1000000);
+
+// Forecast reorder suggestions over 500 products after `range(0)` consumptions, from the smoothed rates
+void BM_ForecastShoppingList(benchmark::State &state) {
+    WorkloadGenerator workload(500);
+    auto fridge = makeQuietRefrigerator();
+    for (size_t i = 0; i < workload.getProductCount(); ++i) {
+        fridge->insertProduct(workload.getName(i), 1, workload.randomExpiration());
+    }
+    fridge->consumeBatch(workload.consumeRecords(static_cast<size_t>(state.range(0))));
+    for (auto _ : state) {
+        fridge->generateForecastShoppingList();
+        fridge->getReportWriter().flush();
+    }
+    state.counters["history_length"] = static_cast<double>(state.range(0));
+}
+BENCHMARK(BM_ForecastShoppingList)->Arg(1000)->Arg(100000)->Arg(1000000);
+
+// Recounting the consumption of 500 products from 10 million history events on `range(0)` pool threads
+void BM_HistoryTally(benchmark::State &state) {
+    WorkloadGenerator workload(500);
+    auto fridge = makeQuietRefrigerator();
+    for (size_t i = 0; i < workload.getProductCount(); ++i) {
+        fridge->insertProduct(workload.getName(i), 1e12, workload.randomExpiration());
+    }
+    fridge->consumeBatch(workload.consumeRecords(10000000));
+    WorkStealingPool pool(static_cast<size_t>(state.range(0)));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(fridge->tallyConsumption(pool));
+    }
+    state.SetItemsProcessed(state.iterations() * 10000000);
+}
+BENCHMARK(BM_HistoryTally)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+// Heap bytes per product for `range(0)` products with `range(1)` lots each, split into the catalog
+// (interned names) and the refrigerator itself (store columns, index, spilled lots)
+void BM_MemoryPerProduct(benchmark::State &state) {
+    size_t productCount = static_cast<size_t>(state.range(0));
+    uint32_t lotsPerProduct = static_cast<uint32_t>(state.range(1));
+    WorkloadGenerator workload(productCount);
+    size_t catalogBytes = 0, fridgeBytes = 0;
+    for (auto _ : state) {
+        size_t before = allocatedBytes.load();
+        auto catalog = make_shared<ProductCatalog>();
+        for (size_t i = 0; i < productCount; ++i) {
+            catalog->intern(workload.getName(i));
+        }
+        size_t afterCatalog = allocatedBytes.load();
+
+        Refrigerator fridge(catalog);
+        fridge.setHistoryRecording(false);
+        for (size_t i = 0; i < productCount; ++i) {
+            for (uint32_t lot = 0; lot < lotsPerProduct; ++lot) {
+                fridge.tryInsert(workload.getName(i), 1, Date(workload.getToday() + 1 + lot));
+            }
+        }
+        catalogBytes = afterCatalog - before;
+        fridgeBytes = allocatedBytes.load() - afterCatalog;
+    }
+    state.counters["catalog_bytes_per_product"] = static_cast<double>(catalogBytes) / static_cast<double>(productCount);
+    state.counters["fridge_bytes_per_product"] = static_cast<double>(fridgeBytes) / static_cast<double>(productCount);
+}
+BENCHMARK(BM_MemoryPerProduct)->Args({100000, 1})->Args({100000, 3})->Iterations(1)->Unit(benchmark::kMillisecond);
+
+} // namespace
+
+BENCHMARK_MAIN();
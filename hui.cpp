@@ -1,222 +1,402 @@
-#include <iostream>
-#include <unordered_map>
-#include <vector>
-#include <string>
-#include <limits> // For numeric_limits (used in future extensions or validations)
+#include "fridge.h"
 
-using namespace std;
+#include <limits> // For numeric_limits, used to skip the rest of a malformed input line
+#include <fstream> // For ofstream, used to write the metrics dump
+#include <csignal> // For signal, used to stop the server on SIGINT / SIGTERM
 
-// Product class represents an individual product stored in the refrigerator.
-class Product {
-private:
-    string name; // The name of the product
-    double quantity; // The quantity of the product in the refrigerator
-    string expirationDate; // The expiration date of the product
+// Function to display the main menu for refrigerator management actions
+// (one write; cin is tied to cout, so it is flushed before the choice is read)
+void showMenu() {
+    cout << "\n*** Refrigerator Menu ***\n"
+            "1. Insert Product\n"
+            "2. Consume Product\n"
+            "3. Show Refrigerator Status\n"
+            "4. Show Action History\n"
+            "5. Check Expired Products\n"
+            "6. Generate Shopping List\n"
+            "7. Exit\n"
+            "8. Show Metrics\n"
+            "9. Show Lowest Stock\n"
+            "10. Show Expiring Soonest\n"
+            "11. Generate Forecast Shopping List\n"
+            "Enter your choice: ";
+}
 
-public:
-    // Default constructor to initialize a product with empty values
-    Product() {
-        this->name = "";
-        this->quantity = 0.0;
-        this->expirationDate = "";
-    }
+// CommandScanner splits a command script into whitespace-separated tokens, keeping track of the line
+// each one is on for error messages
+class CommandScanner {
+private:
+    string_view script;
+    size_t position = 0;
+    size_t line = 1; // Line of the current position
+    size_t tokenLine = 1; // Line of the last token returned
 
-    // Parametrized constructor to initialize the product with specific values
-    Product(const string &productName, double productQuantity, const string &productExpirationDate) {
-        this->name = productName;
-        this->quantity = productQuantity;
-        this->expirationDate = productExpirationDate;
+    static bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
     }
 
-    // Getter method to retrieve the product's name
-    string getName() const {
-        return name;
-    }
+public:
+    explicit CommandScanner(string_view text) : script(text) {}
 
-    // Getter method to retrieve the product's quantity
-    double getQuantity() const {
-        return quantity;
+    // Method to get the next token. Returns false at the end of the script
+    bool next(string_view &token) {
+        while (position < script.size() && isSpace(script[position])) {
+            line += script[position] == '\n' ? 1 : 0;
+            ++position;
+        }
+        if (position == script.size()) {
+            return false;
+        }
+        tokenLine = line;
+        size_t start = position;
+        while (position < script.size() && !isSpace(script[position])) {
+            ++position;
+        }
+        token = script.substr(start, position - start);
+        return true;
     }
 
-    // Getter method to retrieve the product's expiration date
-    string getExpirationDate() const {
-        return expirationDate;
+    // Method to get the next token of the current line, such as an argument of the command just read.
+    // Returns false, leaving the position at the line break, if the line has no more tokens
+    bool nextOnLine(string_view &token) {
+        while (position < script.size() && script[position] != '\n' && isSpace(script[position])) {
+            ++position;
+        }
+        if (position == script.size() || script[position] == '\n') {
+            return false;
+        }
+        return next(token);
     }
 
-    // Method to add a specified quantity to the existing product
-    void addQuantity(double additionalQuantity) {
-        quantity += additionalQuantity;
+    // Method to drop the rest of the current line, e.g. the arguments of a command that could not be read
+    void skipLine() {
+        while (position < script.size() && script[position] != '\n') {
+            ++position;
+        }
     }
 
-    // Method to consume (reduce) the quantity of the product by a specified amount
-    void consumeQuantity(double consumedQuantity) {
-        quantity -= consumedQuantity;
+    size_t getLine() const {
+        return tokenLine;
     }
 };
 
-// Refrigerator class manages multiple products, tracks actions performed, and handles refrigerator operations
-class Refrigerator {
-private:
-    unordered_map<string, Product> products; // A map to store products, using product name as the key
-    vector<string> history; // A log of all actions (insertions, consumptions) performed on the refrigerator
+// Function to parse a whole token as a number with from_chars (no locale, no stream state)
+template <typename T>
+bool parseNumber(string_view token, T &value) {
+    auto result = from_chars(token.data(), token.data() + token.size(), value);
+    return result.ec == errc() && result.ptr == token.data() + token.size();
+}
 
-    // Private helper function to log actions performed on the refrigerator
-    void logAction(const string &action) {
-        history.push_back(action); // Store the action string in the history log
+// Function to read everything from a file descriptor in large chunks
+bool readAllInput(int descriptor, string &contents) {
+    const size_t CHUNK_SIZE = 1 << 20;
+    contents.clear();
+    while (true) {
+        size_t used = contents.size();
+        contents.resize(used + CHUNK_SIZE);
+        ssize_t result = ::read(descriptor, contents.data() + used, CHUNK_SIZE);
+        if (result < 0 && errno == EINTR) {
+            contents.resize(used);
+            continue;
+        }
+        contents.resize(used + (result > 0 ? static_cast<size_t>(result) : 0));
+        if (result <= 0) {
+            return result == 0;
+        }
     }
+}
 
-    // Private helper function to check if a product is expired based on the current date
-    bool isExpired(const string &currentDate, const string &expirationDate) {
-        return currentDate >= expirationDate; // Compare dates (as strings) to determine expiration
+// Function to run a script of menu commands without prompts: the same tokens the interactive menu
+// reads (e.g. "1 milk 2 2025-01-10" inserts milk), read in one go from a file or, for "-", stdin.
+// A command's arguments must be on its own line; one that is cut short is reported and skipped.
+// Everything printed is buffered and written at the end, and the storage (if any) commits in large
+// groups instead of once per command. Returns the process exit code
+int runBatch(const string &path, Refrigerator &fridge, FridgeStorage *storage) {
+    string script;
+    int descriptor = path == "-" ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    bool readOk = descriptor >= 0 && readAllInput(descriptor, script);
+    if (descriptor > STDIN_FILENO) {
+        ::close(descriptor);
+    }
+    if (!readOk) {
+        cerr << "Error: cannot read " << path << ": " << strerror(errno) << endl;
+        return 1;
     }
 
-public:
-    // Method to insert a new product into the refrigerator or update the quantity of an existing product
-    void insertProduct(const string &productName, double productQuantity, const string &productExpirationDate) {
-        // Validation: Ensure the quantity is greater than zero before inserting
-        if (productQuantity <= 0) {
-            cout << "Error: Product quantity must be greater than zero." << endl;
-            return;
-        }
+    ReportWriter &report = fridge.getReportWriter();
+    report.setFlushPolicy(FlushPolicy::Manual);
+    if (storage != nullptr) {
+        storage->setBatchCommits(true);
+    }
 
-        // If the product already exists, update its quantity. Otherwise, insert it as a new product
-        if (products.find(productName) != products.end()) {
-            products[productName].addQuantity(productQuantity); // Add the quantity to the existing product
-        } else {
-            Product newProduct(productName, productQuantity, productExpirationDate); // Create a new product
-            products[productName] = newProduct; // Insert the new product into the map
+    CommandScanner scanner(script);
+    string_view token, productName, quantityText, dateText, countText;
+    bool running = true;
+    // Reports a bad command and resumes at the next line, so its other tokens are not read as commands
+    auto fail = [&](string_view message) {
+        report << "Error: line " << static_cast<uint64_t>(scanner.getLine()) << ": " << message << '\n';
+        scanner.skipLine();
+    };
+    while (running && scanner.next(token)) {
+        uint32_t choice = 0;
+        if (!parseNumber(token, choice)) {
+            fail("expected a menu choice, got '" + string(token) + "'");
+            continue;
         }
 
-        // Log the action of inserting a product
-        logAction("Inserted " + to_string(productQuantity) + " of " + productName);
-    }
+        double productQuantity = 0;
+        Date date;
+        switch (choice) {
+        case 1:
+            if (!scanner.nextOnLine(productName) || !scanner.nextOnLine(quantityText) || !scanner.nextOnLine(dateText)) {
+                fail("incomplete insert command");
+            } else if (!parseNumber(quantityText, productQuantity) || !Quantity::isRepresentable(productQuantity)) {
+                fail("invalid quantity '" + string(quantityText) + "'");
+            } else if (!Date::parse(dateText, date)) {
+                fail("invalid date '" + string(dateText) + "'. Use the format YYYY-MM-DD.");
+            } else {
+                fridge.insertProduct(productName, productQuantity, date);
+            }
+            break;
 
-    // Method to consume (reduce) the quantity of a specific product
-    void consumeProduct(const string &productName, double productQuantity) {
-        // Validation: Ensure the consumed quantity is greater than zero
-        if (productQuantity <= 0) {
-            cout << "Error: Consumed quantity must be greater than zero." << endl;
-            return;
-        }
+        case 2:
+            if (!scanner.nextOnLine(productName) || !scanner.nextOnLine(quantityText)) {
+                fail("incomplete consume command");
+            } else if (!parseNumber(quantityText, productQuantity) || !Quantity::isRepresentable(productQuantity)) {
+                fail("invalid quantity '" + string(quantityText) + "'");
+            } else {
+                fridge.consumeProduct(productName, productQuantity);
+            }
+            break;
 
-        // Check if the product exists in the refrigerator
-        if (products.find(productName) == products.end()) {
-            cout << "Product not found in refrigerator." << endl;
-            return;
-        }
+        case 3:
+            fridge.showStatus();
+            break;
 
-        // Ensure there's enough quantity of the product to consume
-        if (products[productName].getQuantity() < productQuantity) {
-            cout << "Not enough quantity to consume." << endl;
-            return;
-        }
+        case 4:
+            fridge.showHistory();
+            break;
+
+        case 5:
+            if (!scanner.nextOnLine(dateText)) {
+                fail("incomplete expiration check");
+            } else if (!Date::parse(dateText, date)) {
+                fail("invalid date '" + string(dateText) + "'. Use the format YYYY-MM-DD.");
+            } else {
+                fridge.checkExpirations(date);
+            }
+            break;
 
-        // Consume the specified quantity and update the product
-        products[productName].consumeQuantity(productQuantity);
+        case 6:
+            fridge.generateShoppingList();
+            break;
 
-        // Log the action of consuming a product
-        logAction("Consumed " + to_string(productQuantity) + " of " + productName);
+        case 7:
+            running = false; // Anything after an exit is ignored, as in the interactive menu
+            break;
 
-        // If the product quantity reaches zero, remove it from the refrigerator
-        if (products[productName].getQuantity() == 0) {
-            products.erase(productName);
-        }
-    }
+        case 8:
+            fridge.showMetrics();
+            break;
 
-    // Method to display the current status of the refrigerator (list all products with quantities and expiration dates)
-    void showStatus() {
-        cout << "\n--- Current Refrigerator Status ---" << endl;
-        if (products.empty()) {
-            cout << "The refrigerator is empty." << endl;
-            return;
-        }
+        case 9:
+        case 10:
+            if (!scanner.nextOnLine(countText)) {
+                fail("incomplete top-K query");
+            } else if (size_t count = 0; !parseNumber(countText, count)) {
+                fail("invalid product count '" + string(countText) + "'");
+            } else if (choice == 9) {
+                fridge.showLowestStock(count);
+            } else {
+                fridge.showExpiringSoonest(count);
+            }
+            break;
+
+        case 11:
+            fridge.generateForecastShoppingList();
+            break;
 
-        // Iterate through the products and display their information
-        for (const auto &item : products) {
-            cout << "- " << item.second.getName() << ": " << item.second.getQuantity()
-                 << " (Expires: " << item.second.getExpirationDate() << ")" << endl;
+        default:
+            fail("invalid choice " + string(token));
+            break;
         }
     }
 
-    // Method to display the history of actions performed on the refrigerator
-    void showHistory() {
-        cout << "\n--- History of Actions ---" << endl;
-        if (history.empty()) {
-            cout << "No actions recorded yet." << endl;
-            return;
-        }
+    int exitCode = 0;
+    if (storage != nullptr && (!storage->setBatchCommits(false) || !storage->checkpoint())) {
+        report << "Error: " << storage->getLastError() << '\n';
+        exitCode = 1;
+    }
+    report.flush();
+    return exitCode;
+}
 
-        // Iterate through the history and print each action
-        for (const string &entry : history) {
-            cout << "- " << entry << endl;
-        }
+// Function to write the refrigerator's metrics as JSON to a file, if one was asked for
+void writeMetricsFile(const string &path, const Refrigerator &fridge) {
+    if (path.empty()) {
+        return;
     }
+    ofstream file(path, ios::trunc);
+    ReportWriter out(file, FlushPolicy::Manual);
+    fridge.writeMetricsJson(out);
+    out.flush();
+    if (!file) {
+        cerr << "Error: cannot write " << path << endl;
+    }
+}
 
-    // Method to check and remove expired products based on the current date
-    void checkExpirations(const string &currentDate) {
-        cout << "\n--- Checking Expired Products ---" << endl;
-        bool expiredFound = false;
-        // Iterate through the products and check if any are expired
-        for (auto it = products.begin(); it != products.end();) {
-            if (isExpired(currentDate, it->second.getExpirationDate())) {
-                cout << "Product " << it->second.getName() << " has expired. Please remove it." << endl;
-                it = products.erase(it); // Remove expired product from the refrigerator
-                expiredFound = true;
-            } else {
-                ++it;
-            }
-        }
+// Function to print the products of a data directory's snapshot straight from the mapped file,
+// without loading a Refrigerator (safe to run next to the process that owns the directory)
+int showSnapshot(const string &directory) {
+    MappedSnapshot snapshot;
+    if (!snapshot.open(directory + "/fridge.snapshot", false)) {
+        cerr << "Error: " << snapshot.getLastError() << endl;
+        return 1;
+    }
 
-        if (!expiredFound) {
-            cout << "No expired products found." << endl;
+    ReportWriter report;
+    report << "\n--- Snapshot Status ---\n";
+    if (snapshot.getProductCount() == 0) {
+        report << "The refrigerator is empty.\n";
+    }
+    for (uint32_t index = 0; index < snapshot.getProductCount(); ++index) {
+        report << "- " << snapshot.getProductName(index) << ": " << snapshot.getQuantity(index)
+               << " (Expires: " << snapshot.getExpirationDate(index);
+        if (snapshot.getLots(index).size() > 1) {
+            report << ", " << static_cast<uint64_t>(snapshot.getLots(index).size()) << " lots";
         }
+        report << ")\n";
+    }
+    report.endReport();
+    return 0;
+}
+
+// Function to print a shopping list from all the consumption in a data directory's history archive,
+// summed on every hardware thread (safe to run next to the process that owns the directory)
+int showArchiveShoppingList(const string &directory) {
+    FridgeStorage storage(directory);
+    WorkStealingPool pool;
+    unordered_map<string, Quantity> totals;
+    if (!storage.tallyArchivedConsumption(pool, totals)) {
+        cerr << "Error: " << storage.getLastError() << endl;
+        return 1;
     }
 
-    // Method to generate a shopping list based on consumed products
-    void generateShoppingList() {
-        unordered_map<string, double> consumptionMap;
-        // Parse the history to track consumed products and their quantities
-        for (const string &entry : history) {
-            if (entry.find("Consumed") != string::npos) {
-                size_t quantityStart = entry.find(" ") + 1;
-                size_t quantityEnd = entry.find(" of ");
-                double consumedQuantity = stod(entry.substr(quantityStart, quantityEnd - quantityStart));
-                string productName = entry.substr(quantityEnd + 4);
-                consumptionMap[productName] += consumedQuantity; // Aggregate consumed quantities
-            }
-        }
+    ReportWriter report;
+    report << "\n--- Archived Shopping List ---\n";
+    if (totals.empty()) {
+        report << "No items to suggest for shopping.\n";
+    }
+    for (const auto &item : totals) {
+        report << "- Buy more " << item.first << " (" << item.second << ")\n";
+    }
+    report.endReport();
+    return 0;
+}
 
-        cout << "\n--- Generated Shopping List ---" << endl;
-        if (consumptionMap.empty()) {
-            cout << "No items to suggest for shopping." << endl;
-            return;
-        }
+// The server run by --serve, stopped by SIGINT or SIGTERM
+FridgeServer *activeServer = nullptr;
 
-        // Display the shopping list with suggested quantities to buy
-        for (const auto &item : consumptionMap) {
-            cout << "- Buy more " << item.first << " (" << item.second << ")" << endl;
-        }
+void stopServer(int) {
+    if (activeServer != nullptr) {
+        activeServer->stop();
     }
-};
+}
 
-// Function to display the main menu for refrigerator management actions
-void showMenu() {
-    cout << "\n*** Refrigerator Menu ***" << endl;
-    cout << "1. Insert Product" << endl;
-    cout << "2. Consume Product" << endl;
-    cout << "3. Show Refrigerator Status" << endl;
-    cout << "4. Show Action History" << endl;
-    cout << "5. Check Expired Products" << endl;
-    cout << "6. Generate Shopping List" << endl;
-    cout << "7. Exit" << endl;
-    cout << "Enter your choice: ";
+// Function to serve the refrigerator to network clients until interrupted (see FridgeServer for the protocol)
+int runServer(const string &address, Refrigerator &fridge) {
+    FridgeServer server(fridge);
+    if (!server.listen(address)) {
+        cerr << "Error: " << server.getLastError() << endl;
+        return 1;
+    }
+    cout << "Listening on " << address;
+    if (server.getPort() != 0) {
+        cout << " (port " << server.getPort() << ")";
+    }
+    cout << endl;
+
+    activeServer = &server;
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    bool served = server.run();
+    activeServer = nullptr;
+
+    const ServerStats &stats = server.getStats();
+    cout << "Served " << stats.requests << " requests over " << stats.connections << " connections" << endl;
+    if (!served) {
+        cerr << "Error: " << server.getLastError() << endl;
+        return 1;
+    }
+    return 0;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
     Refrigerator fridge; // Create an instance of the Refrigerator class
+    unique_ptr<FridgeStorage> storage; // Optional durable storage, declared after the fridge so it is closed first
     int choice; // User's menu choice
-    string productName, expirationDate, currentDate; // Product-related details
+    string productName, dateInput; // Product-related details
+    Date expirationDate, currentDate; // Parsed dates
     double productQuantity; // Quantity of the product
+    size_t productCount; // Number of products a top-K query lists
+    string batchPath; // Command script to run instead of the interactive menu, if any
+    string metricsPath; // File the metrics are written to at exit, if any
+    string serveAddress; // Address to serve the refrigerator on instead of the interactive menu, if any
+    size_t historyEvents = 0; // Raw history events kept in memory (0 keeps all of them)
+
+    // Command line: --data <directory> keeps the refrigerator state across restarts;
+    // --batch <file|-> runs a script of menu commands without prompts;
+    // --show-snapshot <directory> prints the last snapshot of a data directory and exits;
+    // --archive-shopping-list <directory> prints a shopping list from a data directory's history archive and exits;
+    // --metrics-json <file> writes the operation metrics as JSON when the program ends;
+    // --history-retention <events> keeps only the latest events in memory, archiving older ones with --data;
+    // --serve <unix:path|host:port> serves network clients instead of the menu until interrupted
+    for (int i = 1; i < argc; ++i) {
+        string_view argument = argv[i];
+        if (argument == "--data" && i + 1 < argc) {
+            storage = make_unique<FridgeStorage>(argv[++i]);
+        } else if (argument == "--batch" && i + 1 < argc) {
+            batchPath = argv[++i];
+        } else if (argument == "--metrics-json" && i + 1 < argc) {
+            metricsPath = argv[++i];
+        } else if (argument == "--serve" && i + 1 < argc) {
+            serveAddress = argv[++i];
+        } else if (argument == "--history-retention" && i + 1 < argc) {
+            if (!parseNumber(string_view(argv[++i]), historyEvents)) {
+                cerr << "Error: invalid event count '" << argv[i] << "'" << endl;
+                return 1;
+            }
+        } else if (argument == "--show-snapshot" && i + 1 < argc) {
+            return showSnapshot(argv[i + 1]);
+        } else if (argument == "--archive-shopping-list" && i + 1 < argc) {
+            return showArchiveShoppingList(argv[i + 1]);
+        } else {
+            cerr << "Usage: " << argv[0] << " [--data <directory>] [--batch <file|->] [--metrics-json <file>]"
+                    " [--serve <unix:path|host:port>] [--history-retention <events>] [--show-snapshot <directory>]"
+                    " [--archive-shopping-list <directory>]"
+                 << endl;
+            return 1;
+        }
+    }
+    if (historyEvents != 0) {
+        // Set before the storage is opened, so the events the WAL replay rolls out again are not archived
+        // twice: they already were when they first left the history
+        fridge.setHistoryRetention({historyEvents, 0, true});
+    }
+    if (storage != nullptr && !storage->open(fridge)) {
+        cerr << "Error: " << storage->getLastError() << endl;
+        return 1;
+    }
+    if (!serveAddress.empty()) {
+        int exitCode = runServer(serveAddress, fridge);
+        writeMetricsFile(metricsPath, fridge);
+        return exitCode;
+    }
+    if (!batchPath.empty()) {
+        int exitCode = runBatch(batchPath, fridge, storage.get());
+        writeMetricsFile(metricsPath, fridge);
+        return exitCode;
+    }
 
     cout << "WELCOME!" << endl;
     cout<<"Refrigerator PathLock 2025!"<<endl;
@@ -224,7 +404,16 @@ int main() {
 
     while (true) {
         showMenu(); // Display the menu
-        cin >> choice; // Get user's choice from the menu
+        if (!(cin >> choice)) { // Get user's choice from the menu
+            if (cin.eof()) {
+                break; // No more input; every change is already in the log
+            }
+            // Drop the unreadable line instead of failing on it forever
+            cin.clear();
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            cout << "Invalid choice. Please try again." << endl;
+            continue;
+        }
 
         // Perform actions based on user's choice
         switch (choice) {
@@ -234,7 +423,15 @@ int main() {
             cout << "Enter product quantity: ";
             cin >> productQuantity;
             cout << "Enter expiration date (YYYY-MM-DD): ";
-            cin >> expirationDate;
+            cin >> dateInput;
+            if (!cin || !Quantity::isRepresentable(productQuantity)) {
+                cout << "Error: Invalid quantity." << endl;
+                break;
+            }
+            if (!Date::parse(dateInput, expirationDate)) {
+                cout << "Error: Invalid date. Use the format YYYY-MM-DD." << endl;
+                break;
+            }
             fridge.insertProduct(productName, productQuantity, expirationDate);
             break;
 
@@ -243,6 +440,10 @@ int main() {
             cin >> productName;
             cout << "Enter quantity to consume: ";
             cin >> productQuantity;
+            if (!cin || !Quantity::isRepresentable(productQuantity)) {
+                cout << "Error: Invalid quantity." << endl;
+                break;
+            }
             fridge.consumeProduct(productName, productQuantity);
             break;
 
@@ -256,7 +457,11 @@ int main() {
 
         case 5:
             cout << "Enter current date (YYYY-MM-DD): ";
-            cin >> currentDate;
+            cin >> dateInput;
+            if (!Date::parse(dateInput, currentDate)) {
+                cout << "Error: Invalid date. Use the format YYYY-MM-DD." << endl;
+                break;
+            }
             fridge.checkExpirations(currentDate); // Check for expired products
             break;
 
@@ -265,14 +470,51 @@ int main() {
             break;
 
         case 7:
+            // Compact the log into a snapshot so the next start only has to load it
+            if (storage != nullptr && !storage->checkpoint()) {
+                cerr << "Error: " << storage->getLastError() << endl;
+            }
             cout << "Exiting program. Goodbye!" << endl; // Exit the program
+            writeMetricsFile(metricsPath, fridge);
             return 0;
 
+        case 8:
+            fridge.showMetrics(); // Show operation counts and latencies
+            break;
+
+        case 9:
+        case 10:
+            cout << "Enter number of products: ";
+            if (!(cin >> productCount)) {
+                cout << "Error: Invalid number of products." << endl;
+                break;
+            }
+            if (choice == 9) {
+                fridge.showLowestStock(productCount); // Products closest to running out
+            } else {
+                fridge.showExpiringSoonest(productCount); // Products expiring soonest
+            }
+            break;
+
+        case 11:
+            fridge.generateForecastShoppingList(); // Reorder suggestions from smoothed consumption rates
+            break;
+
         default:
             cout << "Invalid choice. Please try again." << endl; // Handle invalid menu choices
             break;
         }
+
+        // A field that could not be read leaves cin failed: recover at the next line, or stop at the end of input
+        if (!cin) {
+            if (cin.eof()) {
+                break;
+            }
+            cin.clear();
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        }
     }
 
+    writeMetricsFile(metricsPath, fridge);
     return 0;
 }